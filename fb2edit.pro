@@ -1,11 +1,15 @@
 HEADERS = \
     source/fb2html.h \
     source/fb2app.hpp \
+    source/fb2base64.h \
+    source/fb2batch.hpp \
     source/fb2code.hpp \
     source/fb2dlgs.hpp \
     source/fb2dock.hpp \
+    source/fb2hash.h \
     source/fb2head.hpp \
     source/fb2imgs.hpp \
+    source/fb2journal.hpp \
     source/fb2list.hpp \
     source/fb2main.hpp \
     source/fb2note.hpp \
@@ -13,6 +17,7 @@ HEADERS = \
     source/fb2read.hpp \
     source/fb2tree.hpp \
     source/fb2save.hpp \
+    source/fb2space.h \
     source/fb2text.hpp \
     source/fb2utils.h \
     source/fb2xml.hpp \
@@ -22,18 +27,23 @@ HEADERS = \
 
 SOURCES = \
     source/fb2app.cpp \
+    source/fb2base64.cpp \
+    source/fb2batch.cpp \
     source/fb2code.cpp \
     source/fb2dlgs.cpp \
     source/fb2dock.cpp \
+    source/fb2hash.cpp \
     source/fb2head.cpp \
     source/fb2html.cpp \
     source/fb2imgs.cpp \
+    source/fb2journal.cpp \
     source/fb2list.cpp \
     source/fb2main.cpp \
     source/fb2note.cpp \
     source/fb2page.cpp \
     source/fb2read.cpp \
     source/fb2save.cpp \
+    source/fb2space.cpp \
     source/fb2tree.cpp \
     source/fb2xml.cpp \
     source/fb2xml2.cpp \
@@ -62,10 +72,14 @@ CONFIG += c++11
 QMAKE_CXXFLAGS += -std=c++11
 DEFINES += QT_USE_QSTRINGBUILDER
 
+# qmake CONFIG+=count_allocations counts every allocation for --parse-bench
+count_allocations: DEFINES += FB2_COUNT_ALLOCATIONS
+
 OTHER_FILES += \
     source/res/style.css \
     source/res/blank.fb2 \
     source/js/export.js \
+    source/js/units.js \
     source/js/set_cursor.js \
     source/js/get_status.js \
     source/js/insert_title.js \
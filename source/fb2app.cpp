@@ -1,8 +1,12 @@
 #include <QErrorMessage>
+#include <QFileInfo>
 #include <QLocale>
+#include <QMessageBox>
 #include <QTranslator>
 
 #include "fb2app.hpp"
+#include "fb2batch.hpp"
+#include "fb2journal.hpp"
 #include "fb2logs.hpp"
 #include "fb2main.hpp"
 
@@ -35,6 +39,14 @@ int main(int argc, char *argv[])
 {
     Q_INIT_RESOURCE(fb2edit);
 
+    if (FbBatch::requested(argc, argv)) {
+        QCoreApplication app(argc, argv);
+        app.setApplicationName(QString(PACKAGE_NAME));
+        app.setOrganizationName(QString(PACKAGE_VENDOR));
+        app.setApplicationVersion(QString(PACKAGE_VERSION));
+        return FbBatch(app.arguments()).exec();
+    }
+
     FbApplication app(argc, argv);
     app.setApplicationName(QString(PACKAGE_NAME));
     app.setOrganizationName(QString(PACKAGE_VENDOR));
@@ -44,12 +56,29 @@ int main(int argc, char *argv[])
     translator.load(QLocale::system().name(), ":ts");
     app.installTranslator(&translator);
 
+    // Books left in the journal by a session that did not end properly.
+    int recovered = 0;
+    for (const QString &journal: FbJournal::orphans()) {
+        QString source = FbJournal::source(journal);
+        QMessageBox::StandardButton ret = QMessageBox::question(0, app.applicationName(),
+            QObject::tr("The book %1 was not saved when the editor was stopped. Do you want to recover it?").arg(QFileInfo(source).fileName()),
+            QMessageBox::Yes | QMessageBox::No);
+        if (ret == QMessageBox::Yes) {
+            // The book keeps its file, unless that file is gone since.
+            if (!QFileInfo(source).exists()) source.clear();
+            (new FbMainWindow(source, FbMainWindow::FB2, journal))->show();
+            ++recovered;
+        } else {
+            FbJournal::discard(journal);
+        }
+    }
+
     int count = app.arguments().count();
     for (int i = 1; i < count; ++i) {
         QString arg = app.arguments().at(i);
         (new FbMainWindow(arg))->show();
     }
-    if (count == 1) (new FbMainWindow)->show();
+    if (count == 1 && !recovered) (new FbMainWindow)->show();
 
     qInstallMessageHandler(fb2MessageHandler);
 
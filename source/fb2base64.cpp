@@ -0,0 +1,201 @@
+#include "fb2base64.h"
+
+#include <QIODevice>
+
+#include <cstring>
+
+#ifdef __SSSE3__
+#include <tmmintrin.h>
+#endif
+
+#include "fb2hash.h"
+
+static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+//---------------------------------------------------------------------------
+//  FbBase64Encoder
+//---------------------------------------------------------------------------
+
+FbBase64Encoder::FbBase64Encoder(QIODevice *device, bool wrap)
+    : m_device(device)
+    , m_wrap(wrap)
+    , m_length(0)
+{
+}
+
+// Reads whole lines of input, only the last line of the device may be
+// shorter, so the padding can only be at its very end.
+bool FbBase64Encoder::next()
+{
+    m_length = 0;
+    if (!m_device) return false;
+
+    int size = 0;
+    while (size < InputSize) {
+        qint64 count = m_device->read(reinterpret_cast<char*>(m_input) + size, InputSize - size);
+        if (count <= 0) break;
+        size += int(count);
+    }
+
+    QChar *out = m_output;
+    for (int pos = 0; pos < size; pos += LineBytes) {
+        out += encode(m_input + pos, qMin<int>(LineBytes, size - pos), out);
+        if (m_wrap) *out++ = QLatin1Char('\n');
+    }
+    m_length = int(out - m_output);
+    return m_length > 0;
+}
+
+int FbBase64Encoder::encode(const uchar *p, int size, QChar *out)
+{
+    ushort *q = reinterpret_cast<ushort*>(out);
+    const uchar *end = p + size;
+#ifdef __SSSE3__
+    // Twelve bytes give sixteen characters, the indices are split out with
+    // multiplications and turned into characters with a shuffled offset.
+    const __m128i shuffle = _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1);
+    const __m128i offsets = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+        '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+    const __m128i zero = _mm_setzero_si128();
+    while (end - p >= 16) {
+        __m128i in = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p)), shuffle);
+        __m128i hi = _mm_mulhi_epu16(_mm_and_si128(in, _mm_set1_epi32(0x0FC0FC00)), _mm_set1_epi32(0x04000040));
+        __m128i lo = _mm_mullo_epi16(_mm_and_si128(in, _mm_set1_epi32(0x003F03F0)), _mm_set1_epi32(0x01000010));
+        __m128i indices = _mm_or_si128(hi, lo);
+        __m128i range = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+        range = _mm_or_si128(range, _mm_and_si128(_mm_cmpgt_epi8(_mm_set1_epi8(26), indices), _mm_set1_epi8(13)));
+        __m128i chars = _mm_add_epi8(_mm_shuffle_epi8(offsets, range), indices);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(q), _mm_unpacklo_epi8(chars, zero));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(q + 8), _mm_unpackhi_epi8(chars, zero));
+        p += 12;
+        q += 16;
+    }
+#endif
+    for (; end - p >= 3; p += 3, q += 4) {
+        quint32 bits = quint32(p[0]) << 16 | quint32(p[1]) << 8 | p[2];
+        q[0] = alphabet[bits >> 18];
+        q[1] = alphabet[bits >> 12 & 0x3F];
+        q[2] = alphabet[bits >> 6 & 0x3F];
+        q[3] = alphabet[bits & 0x3F];
+    }
+    if (end > p) {
+        quint32 bits = quint32(p[0]) << 16 | (end - p > 1 ? quint32(p[1]) << 8 : 0);
+        q[0] = alphabet[bits >> 18];
+        q[1] = alphabet[bits >> 12 & 0x3F];
+        q[2] = end - p > 1 ? alphabet[bits >> 6 & 0x3F] : '=';
+        q[3] = '=';
+        q += 4;
+    }
+    return int(q - reinterpret_cast<ushort*>(out));
+}
+
+//---------------------------------------------------------------------------
+//  FbBase64Decoder
+//---------------------------------------------------------------------------
+
+class FbBase64Table
+{
+public:
+    enum { Skip = 0xFF };
+    FbBase64Table()
+    {
+        memset(m_table, Skip, sizeof(m_table));
+        for (int i = 0; i < 64; ++i) m_table[uchar(alphabet[i])] = quint8(i);
+    }
+    quint32 operator[](ushort ch) const
+        { return ch < 128 ? m_table[ch] : quint32(Skip); }
+    quint32 operator[](char ch) const
+        { return operator[](ushort(uchar(ch))); }
+private:
+    quint8 m_table[128];
+};
+
+static const FbBase64Table & base64Table()
+{
+    static const FbBase64Table table;
+    return table;
+}
+
+FbBase64Decoder::FbBase64Decoder(QIODevice *device, FbHash *hash)
+    : m_device(device)
+    , m_hash(hash)
+    , m_size(0)
+    , m_bits(0)
+    , m_count(0)
+    , m_length(0)
+    , m_error(false)
+{
+}
+
+void FbBase64Decoder::append(const QChar *data, int size)
+{
+    const ushort *p = reinterpret_cast<const ushort*>(data);
+    decode(p, p + size);
+}
+
+void FbBase64Decoder::append(const char *data, int size)
+{
+    decode(data, data + size);
+}
+
+template <typename T>
+void FbBase64Decoder::decode(const T *p, const T *end)
+{
+    const FbBase64Table &table = base64Table();
+    while (p < end) {
+        // Line breaks come only every 76 characters, so whole quads are
+        // decoded directly and the bit accumulator is used only around them.
+        if (m_count == 0) {
+            while (end - p >= 4) {
+                quint32 a = table[p[0]];
+                quint32 b = table[p[1]];
+                quint32 c = table[p[2]];
+                quint32 d = table[p[3]];
+                if ((a | b | c | d) & 0xC0) break;
+                put(a << 18 | b << 12 | c << 6 | d, 3);
+                p += 4;
+            }
+            if (p == end) break;
+        }
+        quint32 value = table[*p++];
+        if (value == FbBase64Table::Skip) continue;
+        m_bits = m_bits << 6 | value;
+        if (++m_count == 4) {
+            put(m_bits, 3);
+            m_bits = 0;
+            m_count = 0;
+        }
+    }
+}
+
+bool FbBase64Decoder::finish()
+{
+    switch (m_count) {
+        case 2: put(m_bits << 12, 1); break;
+        case 3: put(m_bits << 6, 2); break;
+        default: ;
+    }
+    m_bits = 0;
+    m_count = 0;
+    flush();
+    return !m_error;
+}
+
+void FbBase64Decoder::put(quint32 bits, int count)
+{
+    if (m_length > BufferSize - 3) flush();
+    char *out = m_buffer + m_length;
+    out[0] = char(bits >> 16);
+    out[1] = char(bits >> 8);
+    out[2] = char(bits);
+    m_length += count;
+}
+
+void FbBase64Decoder::flush()
+{
+    if (m_length == 0) return;
+    if (m_hash) m_hash->addData(m_buffer, m_length);
+    if (m_device && m_device->write(m_buffer, m_length) != m_length) m_error = true;
+    m_size += m_length;
+    m_length = 0;
+}
@@ -0,0 +1,66 @@
+#ifndef FB2BASE64_H
+#define FB2BASE64_H
+
+#include <QByteArray>
+#include <QString>
+
+QT_BEGIN_NAMESPACE
+class QIODevice;
+QT_END_NAMESPACE
+
+class FbHash;
+
+// Encodes a device into wrapped base64 lines a buffer at a time, so the
+// memory used does not depend on the size of the binary.
+class FbBase64Encoder
+{
+public:
+    enum { LineSize = 76 };
+    explicit FbBase64Encoder(QIODevice *device, bool wrap = true);
+    bool next();
+    QString text() const { return QString::fromRawData(m_output, m_length); }
+
+private:
+    Q_DISABLE_COPY(FbBase64Encoder)
+    int encode(const uchar *p, int size, QChar *out);
+
+private:
+    enum { LineBytes = LineSize / 4 * 3, Lines = 256, InputSize = LineBytes * Lines };
+    QIODevice *m_device;
+    const bool m_wrap;
+    int m_length;
+    uchar m_input[InputSize];
+    QChar m_output[(LineSize + 1) * Lines];
+};
+
+class FbBase64Decoder
+{
+public:
+    explicit FbBase64Decoder(QIODevice *device, FbHash *hash = 0);
+    void append(const QChar *data, int size);
+    void append(const QString &text) { append(text.constData(), text.size()); }
+    void append(const char *data, int size);
+    void append(const QByteArray &text) { append(text.constData(), text.size()); }
+    bool finish();
+    qint64 size() const { return m_size; }
+    bool hasError() const { return m_error; }
+
+private:
+    Q_DISABLE_COPY(FbBase64Decoder)
+    template <typename T> void decode(const T *p, const T *end);
+    void put(quint32 bits, int count);
+    void flush();
+
+private:
+    enum { BufferSize = 3 * 16 * 1024 };
+    QIODevice *m_device;
+    FbHash *m_hash;
+    qint64 m_size;
+    quint32 m_bits;
+    int m_count;
+    int m_length;
+    bool m_error;
+    char m_buffer[BufferSize];
+};
+
+#endif // FB2BASE64_H
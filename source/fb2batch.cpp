@@ -0,0 +1,461 @@
+#include "fb2batch.hpp"
+
+#include <QCommandLineParser>
+#include <QDirIterator>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QFileInfo>
+#include <QNetworkAccessManager>
+#include <QPair>
+#include <QScopedPointer>
+#include <QTextStream>
+#include <QThread>
+#include <QThreadPool>
+#include <QUrl>
+#include <QXmlStreamWriter>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+
+#include "fb2hash.h"
+#include "fb2imgs.hpp"
+#include "fb2read.hpp"
+#include "fb2save.hpp"
+#include "fb2xml2.h"
+
+//---------------------------------------------------------------------------
+//  Allocation counter
+//---------------------------------------------------------------------------
+
+// Built with FB2_COUNT_ALLOCATIONS on glibc, the allocator is interposed so
+// that the parse benchmark counts the allocations made inside Qt as well.
+// The option is off by default: every allocation of the program then goes
+// through one shared counter, and a sanitizer or another allocator cannot
+// be used with it. The C++ operators allocate through these functions.
+#if defined(FB2_COUNT_ALLOCATIONS) && defined(__GLIBC__)
+static std::atomic<qint64> allocationCount(0);
+
+extern "C" {
+
+void * __libc_malloc(size_t size);
+void * __libc_calloc(size_t count, size_t size);
+void * __libc_realloc(void *ptr, size_t size);
+void * __libc_memalign(size_t alignment, size_t size);
+void * __libc_valloc(size_t size);
+void * __libc_pvalloc(size_t size);
+
+void * malloc(size_t size) __THROW
+{
+    allocationCount.fetch_add(1, std::memory_order_relaxed);
+    return __libc_malloc(size);
+}
+
+void * calloc(size_t count, size_t size) __THROW
+{
+    allocationCount.fetch_add(1, std::memory_order_relaxed);
+    return __libc_calloc(count, size);
+}
+
+void * realloc(void *ptr, size_t size) __THROW
+{
+    allocationCount.fetch_add(1, std::memory_order_relaxed);
+    return __libc_realloc(ptr, size);
+}
+
+void * memalign(size_t alignment, size_t size) __THROW
+{
+    allocationCount.fetch_add(1, std::memory_order_relaxed);
+    return __libc_memalign(alignment, size);
+}
+
+void * aligned_alloc(size_t alignment, size_t size) __THROW
+{
+    return memalign(alignment, size);
+}
+
+int posix_memalign(void **ptr, size_t alignment, size_t size) __THROW
+{
+    if (alignment % sizeof(void*) != 0 || (alignment & (alignment - 1)) != 0) return EINVAL;
+    void *result = memalign(alignment, size);
+    if (!result) return ENOMEM;
+    *ptr = result;
+    return 0;
+}
+
+void * valloc(size_t size) __THROW
+{
+    allocationCount.fetch_add(1, std::memory_order_relaxed);
+    return __libc_valloc(size);
+}
+
+void * pvalloc(size_t size) __THROW
+{
+    allocationCount.fetch_add(1, std::memory_order_relaxed);
+    return __libc_pvalloc(size);
+}
+
+} // extern "C"
+#endif
+
+//---------------------------------------------------------------------------
+//  FbBatchTask
+//---------------------------------------------------------------------------
+
+FbBatchTask::FbBatchTask(FbBatch &owner, const QString &filename, const QString &name)
+    : QObject()
+    , m_owner(owner)
+    , m_filename(filename)
+    , m_name(name)
+    , m_failed(false)
+{
+}
+
+void FbBatchTask::run()
+{
+    m_folder = QDir(m_owner.output().filePath(m_name));
+
+    QFile input(m_filename);
+    if (!input.open(QFile::ReadOnly)) {
+        m_owner.message(QObject::tr("Cannot read file %1: %2.").arg(m_filename).arg(input.errorString()));
+        m_owner.done(0, true);
+        return;
+    }
+
+    // The benchmark converts into memory, so that only the parser is measured.
+    if (m_owner.m_parse) {
+        QString html;
+        QXmlStreamWriter writer(&html);
+        parse(&input, writer);
+        m_owner.done(input.size(), m_failed);
+        return;
+    }
+
+    QFile output(m_owner.output().filePath(m_name + ".html"));
+    if (!QFileInfo(output).dir().mkpath(".") || !output.open(QFile::WriteOnly | QFile::Truncate)) {
+        m_owner.message(QObject::tr("Cannot write file %1: %2.").arg(output.fileName()).arg(output.errorString()));
+        m_owner.done(0, true);
+        return;
+    }
+
+    QXmlStreamWriter writer(&output);
+    parse(&input, writer);
+    m_owner.done(input.size(), m_failed);
+}
+
+void FbBatchTask::parse(QIODevice *input, QXmlStreamWriter &writer)
+{
+    // Binaries stay with this thread, which deletes them once they are written.
+    FbReadHandler handler(writer);
+    handler.setTargetThread(QThread::currentThread());
+    connect(&handler, SIGNAL(binary(FbBinary*)), this, SLOT(binary(FbBinary*)), Qt::DirectConnection);
+    connect(&handler, SIGNAL(error(int,int,QString)), this, SLOT(error(int,int,QString)), Qt::DirectConnection);
+    connect(&handler, SIGNAL(fatal(int,int,QString)), this, SLOT(error(int,int,QString)), Qt::DirectConnection);
+
+    XML2::XmlReader reader;
+    reader.setContentHandler(&handler);
+    reader.setLexicalHandler(&handler);
+    reader.setErrorHandler(&handler);
+    reader.parse(input);
+
+    if (!handler.errorString().isEmpty()) error(0, 0, handler.errorString());
+}
+
+void FbBatchTask::binary(FbBinary *file)
+{
+    QScopedPointer<FbBinary> temp(file);
+    if (m_owner.m_parse) return;
+    if (!m_folder.exists() && !m_folder.mkpath(".")) {
+        error(0, 0, QObject::tr("Cannot create folder %1.").arg(m_folder.path()));
+        return;
+    }
+
+    QFile output(m_folder.filePath(QString(file->name()).replace('/', '_')));
+    const QByteArray data = file->data();
+    if (m_owner.m_benchmark) m_owner.benchmark(data);
+    if (!output.open(QFile::WriteOnly | QFile::Truncate) || output.write(data) != data.size()) {
+        error(0, 0, QObject::tr("Cannot write file %1.").arg(output.fileName()));
+    }
+}
+
+void FbBatchTask::error(int row, int col, const QString &msg)
+{
+    m_failed = true;
+    m_owner.message(QString("%1:%2:%3: %4").arg(m_filename).arg(row).arg(col).arg(msg.simplified()));
+}
+
+//---------------------------------------------------------------------------
+//  FbBatch
+//---------------------------------------------------------------------------
+
+bool FbBatch::requested(int argc, char *argv[])
+{
+    for (int i = 1; i < argc; ++i) {
+        if (qstrcmp(argv[i], "--batch") == 0) return true;
+    }
+    return false;
+}
+
+FbBatch::FbBatch(const QStringList &arguments)
+    : m_output(QDir::current())
+    , m_threads(QThread::idealThreadCount())
+    , m_storeSize(0)
+    , m_benchmark(false)
+    , m_parse(false)
+    , m_fetch(false)
+    , m_bytes(0)
+    , m_count(0)
+    , m_failed(0)
+    , m_hashed(0)
+    , m_md5Time(0)
+    , m_fastTime(0)
+{
+    QCommandLineOption batchOption("batch", QObject::tr("Convert files to HTML without opening any window."));
+    QCommandLineOption outputOption(QStringList() << "o" << "output", QObject::tr("Write results into <dir>."), "dir");
+    QCommandLineOption jobsOption(QStringList() << "j" << "jobs", QObject::tr("Run <n> conversions in parallel."), "n");
+    QCommandLineOption hashOption("hash-bench", QObject::tr("Compare MD5 with the default binary hash on all images."));
+    QCommandLineOption parseOption("parse-bench", QObject::tr("Parse the files into memory and count the allocations made."));
+    QCommandLineOption storeOption("store-bench", QObject::tr("Compare the lookups in a store of <n> binaries with a linear scan."), "n");
+    QCommandLineOption fetchOption("fetch", QObject::tr("Download the given URLs the way images are fetched before saving."));
+
+    QCommandLineParser parser;
+    parser.addOption(batchOption);
+    parser.addOption(outputOption);
+    parser.addOption(jobsOption);
+    parser.addOption(hashOption);
+    parser.addOption(parseOption);
+    parser.addOption(storeOption);
+    parser.addOption(fetchOption);
+    if (!parser.parse(arguments)) {
+        message(parser.errorText());
+        return;
+    }
+
+    m_benchmark = parser.isSet(hashOption);
+    m_parse = parser.isSet(parseOption);
+    if (parser.isSet(storeOption)) m_storeSize = qMax(1, parser.value(storeOption).toInt());
+    m_fetch = parser.isSet(fetchOption);
+    if (parser.isSet(outputOption)) m_output = QDir(parser.value(outputOption));
+    if (parser.isSet(jobsOption)) {
+        int jobs = parser.value(jobsOption).toInt();
+        if (jobs > 0) m_threads = jobs;
+    }
+
+    if (m_fetch) {
+        m_files = parser.positionalArguments();
+    } else {
+        for (const QString &path: parser.positionalArguments()) scan(path);
+    }
+}
+
+// Books found in a folder keep their path relative to it under the output
+// folder, so that books of the same name do not overwrite each other.
+void FbBatch::scan(const QString &path)
+{
+    if (QFileInfo(path).isDir()) {
+        const QDir root(path);
+        QDirIterator it(path, QStringList() << "*.fb2", QDir::Files, QDirIterator::Subdirectories);
+        while (it.hasNext()) {
+            const QString filename = it.next();
+            add(filename, root.relativeFilePath(filename));
+        }
+    } else {
+        add(path, QFileInfo(path).fileName());
+    }
+}
+
+// Names still taken, by books given from different places, get a number.
+void FbBatch::add(const QString &filename, const QString &relative)
+{
+    if (m_names.contains(filename)) return;
+    const QFileInfo info(relative);
+    const QString base = info.path() == "." ? info.completeBaseName() : info.path() + '/' + info.completeBaseName();
+    QString name = base;
+    for (int i = 1; m_used.contains(name.toLower()); ++i) {
+        name = QString("%1(%2)").arg(base).arg(i);
+    }
+    m_used.insert(name.toLower());
+    m_names.insert(filename, name);
+    m_files.append(filename);
+}
+
+int FbBatch::exec()
+{
+    if (m_storeSize) return storeBench();
+
+    if (m_files.isEmpty()) {
+        message(QObject::tr("No input files."));
+        return 1;
+    }
+
+    if (!m_output.mkpath(".")) {
+        message(QObject::tr("Cannot create folder %1.").arg(m_output.path()));
+        return 1;
+    }
+
+    if (m_fetch) return fetch();
+
+    // Largest books go first, so a big file at the end of the list
+    // does not leave the other cores idle.
+    typedef QPair<qint64, QString> FileInfo;
+    QList<FileInfo> files;
+    for (const QString &filename: m_files) {
+        files.append(FileInfo(QFileInfo(filename).size(), filename));
+    }
+    std::sort(files.begin(), files.end(), [](const FileInfo &a, const FileInfo &b) { return a.first > b.first; });
+
+    QThreadPool pool;
+    pool.setMaxThreadCount(m_threads);
+
+    QElapsedTimer timer;
+    timer.start();
+    qint64 allocations = FbBatch::allocations();
+    for (const FileInfo &file: files) {
+        pool.start(new FbBatchTask(*this, file.second, m_names.value(file.second)));
+    }
+    pool.waitForDone();
+    allocations = FbBatch::allocations() - allocations;
+
+    double seconds = qMax<qint64>(timer.elapsed(), 1) / 1000.0;
+    double megabytes = m_bytes.load() / 1048576.0;
+    int count = m_count.load();
+
+    QTextStream out(stdout);
+    out << QObject::tr("Converted %1 files (%2 failed), %3 MB in %4 s using %5 threads")
+        .arg(count).arg(m_failed.load()).arg(megabytes, 0, 'f', 1).arg(seconds, 0, 'f', 2).arg(m_threads) << "\n";
+    out << QObject::tr("%1 files/s, %2 MB/s")
+        .arg(count / seconds, 0, 'f', 1).arg(megabytes / seconds, 0, 'f', 1) << "\n";
+    if (m_benchmark) {
+        double hashed = m_hashed.load() / 1048576.0;
+        out << QObject::tr("Hashed %1 MB of images: MD5 %2 MB/s, fast hash %3 MB/s")
+            .arg(hashed, 0, 'f', 1)
+            .arg(hashed * 1e9 / qMax<qint64>(m_md5Time.load(), 1), 0, 'f', 1)
+            .arg(hashed * 1e9 / qMax<qint64>(m_fastTime.load(), 1), 0, 'f', 1) << "\n";
+    }
+    if (m_parse && allocations > 0) {
+        out << QObject::tr("%1 allocations, %2 per KB of input")
+            .arg(allocations).arg(allocations * 1024.0 / qMax<qint64>(m_bytes.load(), 1), 0, 'f', 1) << "\n";
+    } else if (m_parse) {
+        out << QObject::tr("Allocations are counted only in a glibc build with FB2_COUNT_ALLOCATIONS") << "\n";
+    }
+
+    return m_failed.load() ? 2 : 0;
+}
+
+// Runs the prefetch of images on its own, so that it can be tried against
+// any server, a local stand-in included.
+int FbBatch::fetch()
+{
+    QList<QUrl> urls;
+    for (const QString &arg: m_files) urls.append(QUrl::fromUserInput(arg));
+
+    QNetworkAccessManager manager;
+    FbPrefetch prefetch(&manager);
+    prefetch.setParallel(m_threads);
+
+    QElapsedTimer timer;
+    timer.start();
+    prefetch.exec(urls);
+    double seconds = qMax<qint64>(timer.elapsed(), 1) / 1000.0;
+
+    int count = 0;
+    qint64 bytes = 0;
+    for (int i = 0; i < urls.size(); ++i) {
+        const QByteArray data = prefetch.data(urls.at(i));
+        if (data.isEmpty()) continue;
+        QString name = QString("%1-%2").arg(i + 1).arg(QFileInfo(urls.at(i).path()).fileName());
+        QFile output(m_output.filePath(name));
+        if (!output.open(QFile::WriteOnly | QFile::Truncate) || output.write(data) != data.size()) {
+            message(QObject::tr("Cannot write file %1.").arg(output.fileName()));
+            continue;
+        }
+        bytes += data.size();
+        ++count;
+    }
+
+    QTextStream out(stdout);
+    out << QObject::tr("Downloaded %1 of %2 files, %3 KB in %4 s using %5 connections")
+        .arg(count).arg(urls.size()).arg(bytes / 1024).arg(seconds, 0, 'f', 2).arg(m_threads) << "\n";
+
+    return count == urls.size() ? 0 : 2;
+}
+
+// Times the lookups by name and by hash against a scan of the whole store,
+// which is how binaries were found before the store had its indexes.
+int FbBatch::storeBench()
+{
+    FbStore store(0);
+    QStringList names;
+    QList<QByteArray> hashes;
+    for (int i = 0; i < m_storeSize; ++i) {
+        names << QString("image%1.png").arg(i);
+        hashes << store.set(names.last(), QByteArray::number(i).repeated(16));
+    }
+
+    int found = 0;
+    QElapsedTimer timer;
+    timer.start();
+    for (const QString &name: names) {
+        if (store.get(name)) ++found;
+    }
+    for (const QByteArray &hash: hashes) {
+        if (!store.name(hash).isEmpty()) ++found;
+    }
+    qint64 indexed = timer.nsecsElapsed();
+
+    timer.restart();
+    for (const QString &name: names) {
+        for (int i = 0; i < store.count(); ++i) {
+            if (store.at(i)->name() == name) { ++found; break; }
+        }
+    }
+    for (const QByteArray &hash: hashes) {
+        for (int i = 0; i < store.count(); ++i) {
+            if (store.at(i)->hash() == hash) { ++found; break; }
+        }
+    }
+    qint64 scanned = timer.nsecsElapsed();
+
+    double lookups = 2.0 * m_storeSize;
+    QTextStream out(stdout);
+    out << QObject::tr("Looked up %1 binaries by name and by hash: index %2 ns, scan %3 ns per lookup")
+        .arg(m_storeSize).arg(indexed / lookups, 0, 'f', 1).arg(scanned / lookups, 0, 'f', 1) << "\n";
+
+    return found == 4 * m_storeSize ? 0 : 2;
+}
+
+void FbBatch::done(qint64 size, bool failed)
+{
+    m_bytes.fetchAndAddRelaxed(size);
+    m_count.fetchAndAddRelaxed(1);
+    if (failed) m_failed.fetchAndAddRelaxed(1);
+}
+
+void FbBatch::benchmark(const QByteArray &data)
+{
+    QElapsedTimer timer;
+    timer.start();
+    FbHash::hash(data, FbHash::Md5);
+    m_md5Time.fetchAndAddRelaxed(timer.nsecsElapsed());
+    timer.restart();
+    FbHash::hash(data, FbHash::Fast);
+    m_fastTime.fetchAndAddRelaxed(timer.nsecsElapsed());
+    m_hashed.fetchAndAddRelaxed(data.size());
+}
+
+qint64 FbBatch::allocations()
+{
+#if defined(FB2_COUNT_ALLOCATIONS) && defined(__GLIBC__)
+    return allocationCount.load(std::memory_order_relaxed);
+#else
+    return 0;
+#endif
+}
+
+void FbBatch::message(const QString &text)
+{
+    QMutexLocker locker(&m_mutex);
+    Q_UNUSED(locker);
+    QTextStream(stderr) << text << "\n";
+}
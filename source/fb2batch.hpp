@@ -0,0 +1,82 @@
+#ifndef FB2BATCH_H
+#define FB2BATCH_H
+
+#include <QAtomicInteger>
+#include <QDir>
+#include <QHash>
+#include <QMutex>
+#include <QObject>
+#include <QRunnable>
+#include <QSet>
+#include <QStringList>
+
+QT_BEGIN_NAMESPACE
+class QIODevice;
+class QXmlStreamWriter;
+QT_END_NAMESPACE
+
+class FbBatch;
+class FbBinary;
+
+class FbBatchTask : public QObject, public QRunnable
+{
+    Q_OBJECT
+
+public:
+    explicit FbBatchTask(FbBatch &owner, const QString &filename, const QString &name);
+    void run();
+
+private:
+    void parse(QIODevice *input, QXmlStreamWriter &writer);
+
+private slots:
+    void binary(FbBinary *file);
+    void error(int row, int col, const QString &msg);
+
+private:
+    FbBatch &m_owner;
+    const QString m_filename;
+    const QString m_name;
+    QDir m_folder;
+    bool m_failed;
+};
+
+class FbBatch
+{
+public:
+    static bool requested(int argc, char *argv[]);
+    explicit FbBatch(const QStringList &arguments);
+    int exec();
+
+private:
+    void scan(const QString &path);
+    void add(const QString &filename, const QString &relative);
+    void done(qint64 size, bool failed);
+    void benchmark(const QByteArray &data);
+    static qint64 allocations();
+    int fetch();
+    int storeBench();
+    void message(const QString &text);
+    const QDir & output() const { return m_output; }
+
+private:
+    QStringList m_files;
+    QHash<QString, QString> m_names;
+    QSet<QString> m_used;
+    QDir m_output;
+    int m_threads;
+    int m_storeSize;
+    bool m_benchmark;
+    bool m_parse;
+    bool m_fetch;
+    QMutex m_mutex;
+    QAtomicInteger<qint64> m_bytes;
+    QAtomicInt m_count;
+    QAtomicInt m_failed;
+    QAtomicInteger<qint64> m_hashed;
+    QAtomicInteger<qint64> m_md5Time;
+    QAtomicInteger<qint64> m_fastTime;
+    friend class FbBatchTask;
+};
+
+#endif // FB2BATCH_H
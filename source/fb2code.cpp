@@ -6,6 +6,7 @@
 #include <QXmlSchemaValidator>
 
 #include "fb2dlgs.hpp"
+#include "fb2xml2.h"
 
 //---------------------------------------------------------------------------
 //  FbHighlighter
@@ -546,9 +547,11 @@ void FbCodeEdit::clipboardDataChanged()
 
 bool FbCodeEdit::read(QIODevice *device)
 {
-    QByteArray data = device->readAll();
+    {
+        XML2::XmlMappedFile file(device);
+        setPlainText(QString::fromUtf8(file.data()));
+    }
     delete device;
-    setPlainText(data);
     return true;
 }
 
@@ -1,10 +1,15 @@
 #include "fb2dock.hpp"
 #include "fb2code.hpp"
 #include "fb2head.hpp"
+#include "fb2journal.hpp"
 #include "fb2page.hpp"
+#include "fb2save.hpp"
 #include "fb2text.hpp"
 
 #include <QLayout>
+#include <QScopedPointer>
+#include <QTextCodec>
+#include <QUndoStack>
 #include <QtDebug>
 
 //---------------------------------------------------------------------------
@@ -41,6 +46,7 @@ void FbModeAction::switchMode()
 FbMainDock::FbMainDock(QWidget *parent)
     : QStackedWidget(parent)
     , isSwitched(false)
+    , m_cleanIndex(-1)
 {
     textFrame = new FbTextFrame(this);
     m_text = new FbTextEdit(textFrame, parent);
@@ -50,6 +56,8 @@ FbMainDock::FbMainDock(QWidget *parent)
 
     m_code = new FbCodeEdit(this);
 
+    m_journal = new FbJournal(this);
+
     addWidget(textFrame);
     addWidget(m_head);
     addWidget(m_code);
@@ -71,6 +79,10 @@ FbMainDock::FbMainDock(QWidget *parent)
 void FbMainDock::switchMode(Fb::Mode mode)
 {
     if (mode == m_mode) return;
+    if (m_text->page()->isLoading()) {
+        m_actions[m_mode]->setChecked(true);
+        return;
+    }
     isSwitched = isModified();
     if (currentWidget() == m_code) {
         QString xml = m_code->toPlainText();
@@ -179,16 +191,38 @@ bool FbMainDock::load(const QString &filename)
     return false;
 }
 
-bool FbMainDock::save(QIODevice *device, const QString &codec)
+// The recovered book differs from any file, so it is modified until saved.
+bool FbMainDock::recover(const QString &journal)
+{
+    if (currentWidget() == m_code || !m_journal->restore(journal)) return false;
+    isSwitched = true;
+    return true;
+}
+
+// Takes a snapshot of the book here, the returned thread does the rest.
+FbSaveThread * FbMainDock::save(const QString &filename, const QString &codec)
 {
+    QScopedPointer<FbSaveSnapshot> snapshot(new FbSaveSnapshot);
     if (currentWidget() == m_code) {
-        QTextStream out(device);
-        out << m_code->toPlainText();
+        snapshot->text = m_code->toPlainText();
+        snapshot->codec = QTextCodec::codecForLocale()->name();
+        m_cleanIndex = -1;
     } else {
         isSwitched = false;
-        m_text->save(device, codec);
+        if (QTextCodec *textCodec = QTextCodec::codecForName(codec.toLatin1())) snapshot->codec = textCodec->name();
+        if (!m_text->save(snapshot.data())) return 0;
+        m_cleanIndex = m_text->page()->undoStack()->index();
     }
-    return true;
+    FbSaveThread *thread = new FbSaveThread(this, filename, snapshot.take());
+    connect(thread, SIGNAL(done(bool,QString)), this, SLOT(saved(bool)));
+    return thread;
+}
+
+void FbMainDock::saved(bool ok)
+{
+    QUndoStack *stack = m_text->page()->undoStack();
+    if (ok && m_cleanIndex >= 0 && stack->index() == m_cleanIndex) stack->setClean();
+    if (ok) m_journal->checkpoint();
 }
 
 void FbMainDock::textChanged(bool changed)
@@ -13,6 +13,8 @@
 class FbTextEdit;
 class FbHeadEdit;
 class FbCodeEdit;
+class FbJournal;
+class FbSaveThread;
 
 class FbMainDock : public QStackedWidget
 {
@@ -23,8 +25,10 @@ public:
     FbTextEdit * text() { return m_text; }
     FbHeadEdit * head() { return m_head; }
     FbCodeEdit * code() { return m_code; }
+    FbJournal * journal() { return m_journal; }
     bool load(const QString &filename);
-    bool save(QIODevice *device, const QString &codec = QString());
+    bool recover(const QString &journal);
+    FbSaveThread * save(const QString &filename, const QString &codec = QString());
     Fb::Mode mode() const { return m_mode; }
     void switchMode(Fb::Mode mode);
     void setMode(Fb::Mode mode);
@@ -40,6 +44,7 @@ signals:
 private slots:
     void textChanged(bool changed);
     void error(int row, int col);
+    void saved(bool ok);
 
 private:
     void enableMenu(bool value);
@@ -55,8 +60,10 @@ private:
     FbTextEdit *m_text;
     FbHeadEdit *m_head;
     FbCodeEdit *m_code;
+    FbJournal *m_journal;
     QToolBar *m_tool;
     bool isSwitched;
+    int m_cleanIndex;
     Fb::Mode m_mode;
 };
 
@@ -0,0 +1,212 @@
+#include "fb2hash.h"
+
+#include <QCryptographicHash>
+#include <QSettings>
+#include <QtEndian>
+
+#include <cstring>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+//---------------------------------------------------------------------------
+//  FbHash
+//---------------------------------------------------------------------------
+
+static const quint64 Prime1 = Q_UINT64_C(0x9E3779B185EBCA87);
+static const quint64 Prime2 = Q_UINT64_C(0xC2B2AE3D27D4EB4F);
+static const quint64 Prime3 = Q_UINT64_C(0x165667B19E3779F9);
+static const quint64 Prime4 = Q_UINT64_C(0x9E3779B1);
+
+// The key comes from splitmix64, so digests are the same on every run and
+// every platform, and renditions cached on disk stay valid.
+class FbHashKey
+{
+public:
+    enum { Size = 24 };
+    FbHashKey()
+    {
+        quint64 x = 0;
+        for (int i = 0; i < Size; ++i) {
+            quint64 z = (x += Q_UINT64_C(0x9E3779B97F4A7C15));
+            z = (z ^ (z >> 30)) * Q_UINT64_C(0xBF58476D1CE4E5B9);
+            z = (z ^ (z >> 27)) * Q_UINT64_C(0x94D049BB133111EB);
+            m_words[i] = z ^ (z >> 31);
+        }
+    }
+    const quint64 * words() const { return m_words; }
+private:
+    quint64 m_words[Size];
+};
+
+static const quint64 * hashKey()
+{
+    static const FbHashKey key;
+    return key.words();
+}
+
+// Each 64-bit lane adds the product of the halves of its keyed word and the
+// word of the neighbour lane; the SSE2 loop computes exactly the same sums.
+static void accumulate(quint64 *acc, const uchar *p, int count, const quint64 *key)
+{
+#ifdef __SSE2__
+    __m128i sum[4];
+    for (int j = 0; j < 4; ++j) sum[j] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(acc) + j);
+    for (int s = 0; s < count; ++s, p += 64, ++key) {
+        for (int j = 0; j < 4; ++j) {
+            __m128i data = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p) + j);
+            __m128i keyed = _mm_xor_si128(data, _mm_loadu_si128(reinterpret_cast<const __m128i*>(key) + j));
+            __m128i product = _mm_mul_epu32(keyed, _mm_shuffle_epi32(keyed, _MM_SHUFFLE(0, 3, 0, 1)));
+            __m128i swapped = _mm_shuffle_epi32(data, _MM_SHUFFLE(1, 0, 3, 2));
+            sum[j] = _mm_add_epi64(sum[j], _mm_add_epi64(product, swapped));
+        }
+    }
+    for (int j = 0; j < 4; ++j) _mm_storeu_si128(reinterpret_cast<__m128i*>(acc) + j, sum[j]);
+#else
+    for (int s = 0; s < count; ++s, p += 64, ++key) {
+        for (int i = 0; i < 8; ++i) {
+            quint64 keyed = qFromLittleEndian<quint64>(p + 8 * i) ^ key[i];
+            acc[i] += (keyed & 0xFFFFFFFF) * (keyed >> 32) + qFromLittleEndian<quint64>(p + 8 * (i ^ 1));
+        }
+    }
+#endif
+}
+
+// Both halves of the 128-bit product folded together.
+static quint64 fold(quint64 a, quint64 b)
+{
+#ifdef __SIZEOF_INT128__
+    unsigned __int128 product = static_cast<unsigned __int128>(a) * b;
+    return quint64(product) ^ quint64(product >> 64);
+#else
+    quint64 lolo = (a & 0xFFFFFFFF) * (b & 0xFFFFFFFF);
+    quint64 hilo = (a >> 32) * (b & 0xFFFFFFFF);
+    quint64 lohi = (a & 0xFFFFFFFF) * (b >> 32);
+    quint64 hihi = (a >> 32) * (b >> 32);
+    quint64 cross = (lolo >> 32) + (hilo & 0xFFFFFFFF) + lohi;
+    quint64 upper = (hilo >> 32) + (cross >> 32) + hihi;
+    quint64 lower = (cross << 32) | (lolo & 0xFFFFFFFF);
+    return lower ^ upper;
+#endif
+}
+
+static quint64 avalanche(quint64 h)
+{
+    h ^= h >> 37;
+    h *= Prime3;
+    return h ^ (h >> 32);
+}
+
+FbHash::Algorithm FbHash::defaultAlgorithm()
+{
+    static const Algorithm algorithm = QSettings().value("binaryHash").toString() == "md5" ? Md5 : Fast;
+    return algorithm;
+}
+
+QByteArray FbHash::hash(const QByteArray &data, Algorithm algorithm)
+{
+    FbHash hash(algorithm);
+    hash.addData(data);
+    return hash.result();
+}
+
+FbHash::FbHash(Algorithm algorithm)
+    : m_algorithm(algorithm)
+{
+    if (algorithm == Md5) m_md5.reset(new QCryptographicHash(QCryptographicHash::Md5));
+    reset();
+}
+
+FbHash::~FbHash()
+{
+}
+
+void FbHash::reset()
+{
+    if (m_md5) m_md5->reset();
+    const quint64 *key = hashKey();
+    for (int i = 0; i < 8; ++i) m_acc[i] = key[i] ^ (Prime1 * quint64(i + 1));
+    m_fill = 0;
+    m_stripe = 0;
+    m_total = 0;
+}
+
+void FbHash::addData(const char *data, int size)
+{
+    if (m_md5) {
+        m_md5->addData(data, size);
+        return;
+    }
+
+    const uchar *p = reinterpret_cast<const uchar*>(data);
+    m_total += size;
+    if (m_fill) {
+        int count = qMin(size, int(StripeSize) - m_fill);
+        memcpy(m_buffer + m_fill, p, count);
+        m_fill += count;
+        p += count;
+        size -= count;
+        if (m_fill < StripeSize) return;
+        stripes(m_buffer, 1);
+        m_fill = 0;
+    }
+
+    int count = size / StripeSize;
+    stripes(p, count);
+    p += count * StripeSize;
+    size -= count * StripeSize;
+    memcpy(m_buffer, p, size);
+    m_fill = size;
+}
+
+// Every block of sixteen stripes uses the key at growing offsets
+// and ends with a scramble of the accumulators.
+void FbHash::stripes(const uchar *data, int count)
+{
+    const quint64 *key = hashKey();
+    while (count > 0) {
+        int number = qMin(count, int(BlockStripes) - m_stripe);
+        accumulate(m_acc, data, number, key + m_stripe);
+        data += number * StripeSize;
+        count -= number;
+        m_stripe += number;
+        if (m_stripe < BlockStripes) break;
+        for (int i = 0; i < 8; ++i) {
+            quint64 acc = m_acc[i];
+            acc ^= acc >> 47;
+            acc ^= key[16 + i];
+            m_acc[i] = acc * Prime4;
+        }
+        m_stripe = 0;
+    }
+}
+
+QByteArray FbHash::result() const
+{
+    if (m_md5) return m_md5->result();
+
+    quint64 acc[8];
+    memcpy(acc, m_acc, sizeof(acc));
+    const quint64 *key = hashKey();
+    if (m_fill) {
+        uchar last[StripeSize];
+        memcpy(last, m_buffer, m_fill);
+        memset(last + m_fill, 0, StripeSize - m_fill);
+        accumulate(acc, last, 1, key + m_stripe);
+    }
+
+    quint64 lo = m_total * Prime1;
+    quint64 hi = ~m_total * Prime2;
+    for (int i = 0; i < 8; i += 2) {
+        lo += fold(acc[i] ^ key[i], acc[i + 1] ^ key[i + 1]);
+        hi += fold(acc[i] ^ key[i + 8], acc[i + 1] ^ key[i + 9]);
+    }
+    lo = avalanche(lo);
+    hi = avalanche(hi ^ lo);
+
+    QByteArray digest(16, Qt::Uninitialized);
+    qToLittleEndian(lo, reinterpret_cast<uchar*>(digest.data()));
+    qToLittleEndian(hi, reinterpret_cast<uchar*>(digest.data()) + 8);
+    return digest;
+}
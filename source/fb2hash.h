@@ -0,0 +1,44 @@
+#ifndef FB2HASH_H
+#define FB2HASH_H
+
+#include <QByteArray>
+#include <QScopedPointer>
+
+QT_BEGIN_NAMESPACE
+class QCryptographicHash;
+QT_END_NAMESPACE
+
+// Content hash of binaries, used only to find equal ones. The default is a
+// fast 128-bit non-cryptographic hash; MD5 can be chosen in the settings.
+// Digests are raw bytes.
+class FbHash
+{
+public:
+    enum Algorithm { Fast, Md5 };
+    static Algorithm defaultAlgorithm();
+    static QByteArray hash(const QByteArray &data, Algorithm algorithm = defaultAlgorithm());
+public:
+    explicit FbHash(Algorithm algorithm = defaultAlgorithm());
+    ~FbHash();
+    Algorithm algorithm() const { return m_algorithm; }
+    void addData(const char *data, int size);
+    void addData(const QByteArray &data) { addData(data.constData(), data.size()); }
+    QByteArray result() const;
+    void reset();
+
+private:
+    Q_DISABLE_COPY(FbHash)
+    void stripes(const uchar *data, int count);
+
+private:
+    enum { StripeSize = 64, BlockStripes = 16 };
+    const Algorithm m_algorithm;
+    QScopedPointer<QCryptographicHash> m_md5;
+    quint64 m_acc[8];
+    uchar m_buffer[StripeSize];
+    int m_fill;
+    int m_stripe;
+    quint64 m_total;
+};
+
+#endif // FB2HASH_H
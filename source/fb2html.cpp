@@ -268,6 +268,27 @@ FbTextElement FbTextElement::child(int index) const
     return index ? FbTextElement() : result;
 }
 
+//---------------------------------------------------------------------------
+//  FbRecordReader
+//---------------------------------------------------------------------------
+
+bool FbRecordReader::next()
+{
+    if (m_error || m_pos >= m_end) return false;
+    m_op = (m_pos++)->unicode();
+    int length = 0;
+    for (; m_pos < m_end && m_pos->unicode() >= '0' && m_pos->unicode() <= '9'; ++m_pos) {
+        length = length * 10 + (m_pos->unicode() - '0');
+    }
+    if (m_pos == m_end || *m_pos != ':' || m_end - ++m_pos < length) {
+        m_error = true;
+        return false;
+    }
+    m_text = QString::fromRawData(m_pos, length);
+    m_pos += length;
+    return true;
+}
+
 //---------------------------------------------------------------------------
 //  FbInsertCmd
 //---------------------------------------------------------------------------
@@ -93,6 +93,25 @@ private:
     TypeList::const_iterator subtype(const TypeList &list, const QString &style);
 };
 
+// Reads the records returned by the page scripts: an operation letter, the
+// length of the text, a colon and the text, which is a raw view into them.
+class FbRecordReader
+{
+public:
+    explicit FbRecordReader(const QString &records)
+        : m_pos(records.constData()), m_end(m_pos + records.size()), m_op(0), m_error(false) {}
+    bool next();
+    bool hasError() const { return m_error; }
+    ushort op() const { return m_op; }
+    const QString & text() const { return m_text; }
+private:
+    const QChar *m_pos;
+    const QChar *m_end;
+    QString m_text;
+    ushort m_op;
+    bool m_error;
+};
+
 class FbInsertCmd : public QUndoCommand
 {
 public:
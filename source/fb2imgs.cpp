@@ -2,20 +2,31 @@
 
 #include <QAbstractListModel>
 #include <QBuffer>
-#include <QCryptographicHash>
+#include <QCoreApplication>
 #include <QDialogButtonBox>
+#include <QDir>
 #include <QFileDialog>
 #include <QFileInfo>
+#include <QImage>
 #include <QImageReader>
 #include <QLabel>
 #include <QLineEdit>
+#include <QSaveFile>
+#include <QSettings>
 #include <QSplitter>
+#include <QStandardPaths>
+#include <QThreadPool>
 #include <QUrl>
 #include <QVBoxLayout>
 #include <QWebFrame>
 #include <QTabWidget>
+#include <QThread>
 #include <QtDebug>
 
+#include <climits>
+
+#include "fb2base64.h"
+#include "fb2hash.h"
 #include "fb2list.hpp"
 #include "fb2page.hpp"
 #include "fb2text.hpp"
@@ -26,40 +37,452 @@ static QString imgHtml(const QUrl &url)
     return QString("<img src=\"%1\" valign=center align=center width=100%>").arg(url.toString());
 }
 
+//---------------------------------------------------------------------------
+//  FbBinaryPack
+//---------------------------------------------------------------------------
+
+FbBinaryPack & FbBinaryPack::instance()
+{
+    static FbBinaryPack pack;
+    return pack;
+}
+
+FbBinaryPack::FbBinaryPack()
+    : m_file(new QTemporaryFile)
+    , m_map(0)
+    , m_mapped(0)
+    , m_size(0)
+    , m_garbage(0)
+    , m_resident(0)
+{
+    // The threshold is set in kilobytes, the limit in megabytes.
+    QSettings settings;
+    m_threshold = settings.value("memoryThreshold", 64).toLongLong() * 1024;
+    m_limit = settings.value("memoryLimit", 32).toLongLong() * 1024 * 1024;
+}
+
+FbBinaryPack::~FbBinaryPack()
+{
+    if (m_map) m_file->unmap(m_map);
+    for (const Entry &entry: m_entries) delete entry.segment;
+}
+
+int FbBinaryPack::append(const QByteArray &data, const QByteArray &hash)
+{
+    QMutexLocker locker(&m_mutex);
+    Q_UNUSED(locker);
+    QHash<QByteArray, int>::const_iterator it = m_hashes.constFind(hash);
+    if (!hash.isEmpty() && it != m_hashes.constEnd()) {
+        ++m_entries[it.value()].refs;
+        return it.value();
+    }
+
+    Entry entry = { -1, data.size(), 1, hash, QByteArray() };
+    if (data.size() <= m_threshold && m_resident + data.size() <= m_limit) {
+        entry.data = data;
+        m_resident += data.size();
+        return insert(entry);
+    }
+
+    if (!openFile()) return -1;
+    if (!m_file->seek(m_size) || m_file->write(data) != data.size() || !m_file->flush()) {
+        qCritical() << QObject::tr("Cannot write temporary file: %1.").arg(m_file->errorString());
+        return -1;
+    }
+
+    entry.offset = m_size;
+    m_size += data.size();
+    return insert(entry);
+}
+
+bool FbBinaryPack::openFile()
+{
+    if (m_file->isOpen() || m_file->open()) return true;
+    qCritical() << QObject::tr("Cannot create temporary file: %1.").arg(m_file->errorString());
+    return false;
+}
+
+// A new segment is written by its binary alone, without the lock.
+QTemporaryFile * FbBinaryPack::begin()
+{
+    QTemporaryFile *segment = new QTemporaryFile;
+    if (segment->open()) return segment;
+    qCritical() << QObject::tr("Cannot create temporary file: %1.").arg(segment->errorString());
+    delete segment;
+    return 0;
+}
+
+// Content already in the pack is shared and the segment is dropped.
+int FbBinaryPack::commit(QTemporaryFile *segment, const QByteArray &hash)
+{
+    QMutexLocker locker(&m_mutex);
+    Q_UNUSED(locker);
+    QHash<QByteArray, int>::const_iterator it = m_hashes.constFind(hash);
+    if (!hash.isEmpty() && it != m_hashes.constEnd()) {
+        ++m_entries[it.value()].refs;
+        delete segment;
+        return it.value();
+    }
+    if (!segment->flush()) {
+        qCritical() << QObject::tr("Cannot write temporary file: %1.").arg(segment->errorString());
+        delete segment;
+        return -1;
+    }
+
+    Entry entry = { 0, segment->size(), 1, hash, QByteArray(), segment, 0 };
+    return insert(entry);
+}
+
+void FbBinaryPack::cancel(QTemporaryFile *segment)
+{
+    delete segment;
+}
+
+int FbBinaryPack::insert(const Entry &entry)
+{
+    int index = m_entries.size();
+    if (m_unused.isEmpty()) {
+        m_entries.append(entry);
+    } else {
+        index = m_unused.takeLast();
+        m_entries[index] = entry;
+    }
+    if (!entry.hash.isEmpty()) m_hashes.insert(entry.hash, index);
+    return index;
+}
+
+int FbBinaryPack::acquire(int index)
+{
+    QMutexLocker locker(&m_mutex);
+    Q_UNUSED(locker);
+    if (index < 0 || index >= m_entries.size() || m_entries.at(index).length < 0) return -1;
+    ++m_entries[index].refs;
+    return index;
+}
+
+QByteArray FbBinaryPack::read(int index)
+{
+    QMutexLocker locker(&m_mutex);
+    Q_UNUSED(locker);
+    if (index < 0 || index >= m_entries.size()) return QByteArray();
+    const Entry &entry = m_entries.at(index);
+    if (entry.offset < 0) return entry.data;
+    if (const uchar *map = address(index)) return QByteArray(reinterpret_cast<const char*>(map), int(entry.length));
+    QTemporaryFile *file = entry.segment ? entry.segment : m_file.data();
+    if (!file->seek(entry.offset)) return QByteArray();
+    return file->read(entry.length);
+}
+
+qint64 FbBinaryPack::read(int index, qint64 offset, char *data, qint64 maxSize)
+{
+    QMutexLocker locker(&m_mutex);
+    Q_UNUSED(locker);
+    if (index < 0 || index >= m_entries.size()) return -1;
+    const Entry &entry = m_entries.at(index);
+    qint64 count = qMin(maxSize, entry.length - offset);
+    if (count <= 0) return 0;
+    if (entry.offset < 0) {
+        memcpy(data, entry.data.constData() + offset, count);
+        return count;
+    }
+    if (const uchar *map = address(index)) {
+        memcpy(data, map + offset, count);
+        return count;
+    }
+    QTemporaryFile *file = entry.segment ? entry.segment : m_file.data();
+    if (!file->seek(entry.offset + offset)) return -1;
+    return file->read(data, count);
+}
+
+// A segment is mapped on its first read, the pack file whenever it has grown.
+const uchar * FbBinaryPack::address(int index)
+{
+    Entry &entry = m_entries[index];
+    if (entry.segment) {
+        if (!entry.map) entry.map = entry.segment->map(0, entry.length);
+        return entry.map;
+    }
+    if (entry.offset + entry.length > m_mapped) remap();
+    return m_map ? m_map + entry.offset : 0;
+}
+
+void FbBinaryPack::remove(int index)
+{
+    QMutexLocker locker(&m_mutex);
+    Q_UNUSED(locker);
+    if (index < 0 || index >= m_entries.size()) return;
+    Entry &entry = m_entries[index];
+    if (entry.length < 0 || --entry.refs > 0) return;
+    if (!entry.hash.isEmpty() && m_hashes.value(entry.hash, -1) == index) m_hashes.remove(entry.hash);
+    bool resident = entry.offset < 0;
+    QTemporaryFile *segment = entry.segment;
+    if (resident) m_resident -= entry.length; else if (!segment) m_garbage += entry.length;
+    entry.length = -1;
+    entry.hash.clear();
+    entry.data.clear();
+    entry.segment = 0;
+    entry.map = 0;
+    m_unused.append(index);
+    delete segment;
+    if (resident || segment) return;
+    if (m_garbage == m_size || (m_garbage > CompactSize && m_garbage * 2 > m_size)) compact();
+}
+
+void FbBinaryPack::remap()
+{
+    if (m_map) m_file->unmap(m_map);
+    m_map = m_size > 0 ? m_file->map(0, m_size) : 0;
+    m_mapped = m_map ? m_size : 0;
+}
+
+// Copies the binaries still in use into a new file, so the space of the
+// removed ones is given back; an empty pack is just truncated.
+void FbBinaryPack::compact()
+{
+    if (m_map) m_file->unmap(m_map);
+    m_map = 0;
+    m_mapped = 0;
+
+    if (m_garbage == m_size) {
+        m_file->resize(0);
+        m_size = 0;
+        m_garbage = 0;
+        return;
+    }
+
+    QScopedPointer<QTemporaryFile> file(new QTemporaryFile);
+    if (!file->open()) return;
+    QVector<qint64> offsets(m_entries.size(), 0);
+    qint64 size = 0;
+    for (int i = 0; i < m_entries.size(); ++i) {
+        const Entry &entry = m_entries.at(i);
+        offsets[i] = entry.offset;
+        if (entry.length < 0 || entry.offset < 0 || entry.segment) continue;
+        if (!m_file->seek(entry.offset)) return;
+        QByteArray data = m_file->read(entry.length);
+        if (data.size() != entry.length || file->write(data) != entry.length) return;
+        offsets[i] = size;
+        size += entry.length;
+    }
+    if (!file->flush()) return;
+
+    for (int i = 0; i < m_entries.size(); ++i) m_entries[i].offset = offsets.at(i);
+    m_file.swap(file);
+    m_size = size;
+    m_garbage = 0;
+}
+
 //---------------------------------------------------------------------------
 //  FbBinary
 //---------------------------------------------------------------------------
 
 FbBinary::FbBinary(const QString &name)
-    : QTemporaryFile()
+    : QIODevice()
     , m_name(name)
-    , m_size(0)
+    , m_offset(0)
+    , m_length(0)
+    , m_written(0)
+    , m_stream(0)
+    , m_index(-1)
+    , m_sniffed(false)
 {
 }
 
-qint64 FbBinary::write(QByteArray &data)
+FbBinary::~FbBinary()
 {
-    open();
-    if (m_hash.isEmpty()) m_hash = md5(data);
-    m_size = QTemporaryFile::write(data);
-    QBuffer buffer(&data);
-    buffer.open(QIODevice::ReadOnly);
-    m_type = QImageReader::imageFormat(&buffer);
+    FbBinaryPack &pack = FbBinaryPack::instance();
+    if (m_stream) pack.cancel(m_stream);
+    if (m_index >= 0) pack.remove(m_index);
+}
+
+qint64 FbBinary::write(const QByteArray &data)
+{
+    open(WriteOnly);
+    if (m_info.hash.isEmpty()) m_info.hash = FbHash::hash(data);
+    QIODevice::write(data);
+    m_sniffed = false;
+    finish();
+    return m_info.size;
+}
+
+void FbBinary::finish()
+{
+    m_info.size = m_written;
     close();
-    return m_size;
+
+    FbBinaryPack &pack = FbBinaryPack::instance();
+    int index;
+    if (m_stream) {
+        if (!m_sniffed) sniff(m_head);
+        index = pack.commit(m_stream, m_info.hash);
+        m_stream = 0;
+    } else {
+        if (!m_sniffed) sniff(m_buffer);
+        index = pack.append(m_buffer, m_info.hash);
+    }
+    if (m_index >= 0) pack.remove(m_index);
+    m_index = index;
+    m_buffer = QByteArray();
+    m_head = QByteArray();
 }
 
-QString FbBinary::md5(const QByteArray &data)
+// Makes this binary one more reference to the content of the other one.
+void FbBinary::share(FbBinary &file)
 {
-    return QCryptographicHash::hash(data, QCryptographicHash::Md5).toBase64();
+    if (!file.isLoaded()) file.load();
+    FbBinaryPack &pack = FbBinaryPack::instance();
+    int index = pack.acquire(file.m_index);
+    if (m_index >= 0) pack.remove(m_index);
+    m_index = index;
+    m_info = file.m_info;
+    m_sniffed = true;
+    m_source.clear();
+}
+
+void FbBinary::setType(const QString &type)
+{
+    if (type.startsWith("image/", Qt::CaseInsensitive)) m_info.type = type.toLower();
+}
+
+// Reads the format and the picture size from the header only; the format
+// found there wins over the content-type attribute given by the book.
+void FbBinary::sniff(QByteArray &data)
+{
+    QBuffer buffer(&data);
+    QImageReader reader(&buffer);
+    const QByteArray format = reader.format();
+    if (!format.isEmpty()) m_info.type = "image/" + QString::fromLatin1(format);
+    QSize size = reader.size();
+    m_info.width = qMax(size.width(), 0);
+    m_info.height = qMax(size.height(), 0);
+    m_sniffed = true;
+}
+
+// Opened for reading, the binary streams its data from the pack.
+bool FbBinary::open(OpenMode mode)
+{
+    if ((mode & ReadOnly) && !isLoaded()) load();
+    if (mode & WriteOnly) {
+        if (m_stream) FbBinaryPack::instance().cancel(m_stream);
+        m_stream = 0;
+        m_buffer.clear();
+        m_written = 0;
+    }
+    return QIODevice::open(mode | Unbuffered);
+}
+
+qint64 FbBinary::readData(char *data, qint64 maxSize)
+{
+    return FbBinaryPack::instance().read(m_index, pos(), data, maxSize);
+}
+
+qint64 FbBinary::writeData(const char *data, qint64 maxSize)
+{
+    if (m_stream) {
+        if (m_stream->write(data, maxSize) != maxSize) return -1;
+        m_written += maxSize;
+        return maxSize;
+    }
+
+    m_buffer.append(data, int(maxSize));
+    m_written += maxSize;
+    if (m_buffer.size() <= StreamSize) return maxSize;
+
+    // Too big to be collected: the rest goes straight to a segment file.
+    m_stream = FbBinaryPack::instance().begin();
+    if (!m_stream) return -1;
+    m_head = m_buffer.left(HeaderSize);
+    bool ok = m_stream->write(m_buffer) == m_buffer.size();
+    m_buffer = QByteArray();
+    return ok ? maxSize : -1;
+}
+
+// The path is canonical and the data, if given, is the encoded binary itself,
+// so that many binaries of one file are set up without touching the file.
+void FbBinary::setSource(const QString &path, const QDateTime &modified, qint64 offset, qint64 length, const QString &type, const char *data)
+{
+    m_source = path;
+    m_modified = modified;
+    m_offset = offset;
+    m_length = length;
+    m_info.size = length / 4 * 3;
+    setType(type);
+    if (!data) return;
+
+    // A few hundred bytes hold the header of PNG and GIF, and of most JPEG
+    // files; any other image is sniffed again when it is loaded.
+    QByteArray head;
+    QBuffer buffer(&head);
+    buffer.open(QIODevice::WriteOnly);
+    FbBase64Decoder decoder(&buffer);
+    decoder.append(data, int(qMin<qint64>(length, SniffSize)));
+    decoder.finish();
+    buffer.close();
+    sniff(head);
+    m_sniffed = m_info.width > 0;
+}
+
+// Decodes only the header of a lazy binary from its file, for the images
+// whose size was not found in the first bytes when the book was read.
+bool FbBinary::probe()
+{
+    if (m_source.isEmpty()) return m_sniffed;
+
+    QFile file(m_source);
+    if (QFileInfo(file).lastModified() != m_modified || !file.open(QFile::ReadOnly)) return false;
+    qint64 size = qMin<qint64>(m_length, HeaderSize / 3 * 4);
+    uchar *data = file.map(m_offset, size);
+    if (!data) return false;
+
+    QByteArray head;
+    QBuffer buffer(&head);
+    buffer.open(QIODevice::WriteOnly);
+    FbBase64Decoder decoder(&buffer);
+    decoder.append(reinterpret_cast<const char*>(data), int(size));
+    decoder.finish();
+    buffer.close();
+    file.unmap(data);
+    sniff(head);
+    m_sniffed = m_info.width > 0;
+    return m_sniffed;
+}
+
+bool FbBinary::load()
+{
+    if (m_source.isEmpty()) return true;
+
+    QFile file(m_source);
+    m_source.clear();
+    if (QFileInfo(file).lastModified() != m_modified) {
+        qCritical() << tr("File %1 was changed, cannot load image %2.").arg(file.fileName()).arg(m_name);
+        return false;
+    }
+    if (!file.open(QFile::ReadOnly) || !file.seek(m_offset) || !open(WriteOnly)) {
+        qCritical() << tr("Cannot load image %1: %2.").arg(m_name).arg(file.errorString());
+        return false;
+    }
+
+    FbHash hash;
+    FbBase64Decoder decoder(this, &hash);
+    qint64 rest = m_length;
+    while (rest > 0) {
+        QByteArray chunk = file.read(qMin<qint64>(rest, 64 * 1024));
+        if (chunk.isEmpty()) break;
+        decoder.append(chunk);
+        rest -= chunk.size();
+    }
+    bool ok = decoder.finish() && rest == 0;
+    m_info.hash = hash.result();
+    finish();
+    if (!ok) qCritical() << tr("Cannot load image %1.").arg(m_name);
+    emit loaded(this);
+    return ok;
 }
 
 QByteArray FbBinary::data()
 {
-    open();
-    QByteArray data = readAll();
-    close();
-    return data;
+    if (!isLoaded()) load();
+    return FbBinaryPack::instance().read(m_index);
 }
 
 //---------------------------------------------------------------------------
@@ -68,7 +491,16 @@ QByteArray FbBinary::data()
 
 FbStore::FbStore(QObject *parent)
     : QObject(parent)
+    , m_hits(0)
+    , m_misses(0)
 {
+    // The budget is set in megabytes, the cache counts kilobytes.
+    setCacheSize(QSettings().value("imageCache", 64).toLongLong() * 1024 * 1024);
+}
+
+void FbStore::setCacheSize(qint64 bytes)
+{
+    m_cache.setMaxCost(int(qBound<qint64>(0, bytes / 1024, INT_MAX)));
 }
 
 FbStore::~FbStore()
@@ -77,21 +509,90 @@ FbStore::~FbStore()
     while (it.hasNext()) delete it.next();
 }
 
-void FbStore::binary(const QString &name, const QByteArray &data)
+// The hash of a lazy binary is known only after it is decoded, wherever
+// that happens, so it is indexed then.
+void FbStore::index(FbBinary *file)
 {
-    set(name, data);
+    m_names.insert(file->name(), file);
+    indexHash(file);
+    if (!file->isLoaded()) connect(file, SIGNAL(loaded(FbBinary*)), SLOT(indexHash(FbBinary*)), Qt::UniqueConnection);
+}
+
+void FbStore::indexHash(FbBinary *file)
+{
+    const QByteArray &hash = file->hash();
+    if (!hash.isEmpty() && !m_hashes.contains(hash, file)) m_hashes.insert(hash, file);
+}
+
+// Binaries with the same content keep their own entries.
+void FbStore::unindex(FbBinary *file)
+{
+    m_hashes.remove(file->hash(), file);
+}
+
+// A lazy binary is hashed only when it is loaded, so the ones that may be
+// of the given size are loaded to be found by their hash. The size of a lazy
+// binary is guessed from its base64 text, line breaks and indents included.
+void FbStore::loadSimilar(qint64 size)
+{
+    FbTemporaryIterator it(*this);
+    while (it.hasNext()) {
+        FbBinary *file = it.next();
+        if (file->isLoaded() || size > file->size() || size < file->size() / 4 * 3) continue;
+        file->load();
+    }
+}
+
+void FbStore::binary(FbBinary *file)
+{
+    FbBinary *old = get(file->name());
+    if (old) {
+        m_cache.remove(old->name());
+        unindex(old);
+        replace(indexOf(old), file);
+        delete old;
+    } else {
+        append(file);
+    }
+    index(file);
+    emit changed(file);
 }
 
 QString FbStore::add(const QString &path, QByteArray &data)
 {
-    QString hash = FbBinary::md5(data);
+    QByteArray hash = FbHash::hash(data);
     QString name = this->name(hash);
+    if (name.isEmpty()) {
+        loadSimilar(data.size());
+        name = this->name(hash);
+    }
     if (name.isEmpty()) {
         name = newName(path);
         FbBinary * temp = new FbBinary(name);
         temp->setHash(hash);
         temp->write(data);
         append(temp);
+        index(temp);
+        emit changed(temp);
+    }
+    return name;
+}
+
+QString FbStore::add(FbBinary *file)
+{
+    if (!file->isLoaded()) file->load();
+    QString name = this->name(file->hash());
+    if (name.isEmpty()) {
+        loadSimilar(file->size());
+        name = this->name(file->hash());
+    }
+    if (name.isEmpty()) {
+        name = newName(file->name());
+        FbBinary * temp = new FbBinary(name);
+        temp->share(*file);
+        append(temp);
+        index(temp);
+        emit changed(temp);
     }
     return name;
 }
@@ -112,51 +613,64 @@ QString FbStore::newName(const QString &path)
 
 FbBinary * FbStore::get(const QString &name) const
 {
-    FbTemporaryIterator it(*this);
-    while (it.hasNext()) {
-        FbBinary * file = it.next();
-        if (file->name() == name) return file;
-    }
-    return NULL;
+    return m_names.value(name);
 }
 
 QByteArray FbStore::data(const QString &name) const
 {
-    FbTemporaryIterator it(*this);
-    while (it.hasNext()) {
-        FbBinary *file = it.next();
-        if (file->name() == name) return file->data();
+    if (QByteArray *data = m_cache.object(name)) {
+        ++m_hits;
+        return *data;
     }
-    return QByteArray();
+
+    FbBinary *file = get(name);
+    if (!file) return QByteArray();
+    ++m_misses;
+
+    QByteArray data = file->data();
+    m_cache.insert(name, new QByteArray(data), int(data.size() / 1024) + 1);
+    return data;
 }
 
-const QString & FbStore::set(const QString &name, QByteArray data, const QString &hash)
+const QByteArray & FbStore::set(const QString &name, QByteArray data, const QByteArray &hash)
 {
     FbBinary * file = get(name);
-    if (!file) append(file = new FbBinary(name));
+    if (file) {
+        m_cache.remove(name);
+        unindex(file);
+    } else {
+        append(file = new FbBinary(name));
+    }
     file->setHash(hash);
     file->write(data);
+    index(file);
+    emit changed(file);
     return file->hash();
 }
 
-QString FbStore::name(const QString &hash) const
+QString FbStore::name(const QByteArray &hash) const
 {
+    FbBinary *file = m_hashes.value(hash);
+    return file ? file->name() : QString();
+}
+
+void FbStore::detach(const QString &filename)
+{
+    const QString path = QFileInfo(filename).canonicalFilePath();
+    if (path.isEmpty()) return;
     FbTemporaryIterator it(*this);
     while (it.hasNext()) {
         FbBinary *file = it.next();
-        if (file->hash() == hash) return file->name();
+        if (!file->isLoaded() && file->source() == path) {
+            file->load();
+            emit changed(file);
+        }
     }
-    return QString();
 }
 
 bool FbStore::exists(const QString &name) const
 {
-    FbTemporaryIterator it(*this);
-    while (it.hasNext()) {
-        FbBinary *file = it.next();
-        if (file->name() == name) return true;
-    }
-    return false;
+    return m_names.contains(name);
 }
 
 #if 0
@@ -183,41 +697,234 @@ QIODevice * FbNetworkDiskCache::data(const QUrl &url)
 //  FbImageReply
 //---------------------------------------------------------------------------
 
+// Parses "bytes=first-last", "bytes=first-" and "bytes=-suffix".
+static bool parseRange(const QByteArray &header, qint64 size, qint64 &first, qint64 &last)
+{
+    if (!header.startsWith("bytes=") || header.contains(',')) return false;
+    const QByteArray range = header.mid(6).trimmed();
+    int dash = range.indexOf('-');
+    if (dash < 0) return false;
+    bool ok1 = true, ok2 = true;
+    const QByteArray head = range.left(dash).trimmed();
+    const QByteArray tail = range.mid(dash + 1).trimmed();
+    if (head.isEmpty()) {
+        qint64 suffix = tail.toLongLong(&ok2);
+        first = qMax<qint64>(0, size - suffix);
+        last = size - 1;
+    } else {
+        first = head.toLongLong(&ok1);
+        last = tail.isEmpty() ? size - 1 : qMin(tail.toLongLong(&ok2), size - 1);
+    }
+    return ok1 && ok2 && 0 <= first && first <= last;
+}
+
 FbImageReply::FbImageReply(QNetworkAccessManager::Operation op, const QNetworkRequest &request, const QByteArray &data)
+    : FbImageReply(op, request)
+{
+    setContent(data);
+}
+
+// The content of this reply is set later, when its rendition is ready.
+FbImageReply::FbImageReply(QNetworkAccessManager::Operation op, const QNetworkRequest &request)
     : QNetworkReply()
-    , content(data)
     , offset(0)
+    , end(0)
 {
     setOperation(op);
     setRequest(request);
     setUrl(request.url());
     open(ReadOnly | Unbuffered);
-    setHeader(QNetworkRequest::ContentLengthHeader, QVariant(content.size()));
+}
+
+void FbImageReply::setContent(const QByteArray &data)
+{
+    content = data;
+    offset = 0;
+    end = data.size();
+
+    // The reply shares the buffer of the store, a range only moves the bounds.
+    qint64 first, last;
+    if (parseRange(request().rawHeader("Range"), content.size(), first, last)) {
+        offset = first;
+        end = last + 1;
+        setAttribute(QNetworkRequest::HttpStatusCodeAttribute, 206);
+        setRawHeader("Content-Range", QString("bytes %1-%2/%3").arg(first).arg(last).arg(content.size()).toLatin1());
+    } else {
+        setAttribute(QNetworkRequest::HttpStatusCodeAttribute, 200);
+    }
+    setRawHeader("Accept-Ranges", "bytes");
+    setHeader(QNetworkRequest::ContentLengthHeader, QVariant(end - offset));
     setAttribute(QNetworkRequest::CacheSaveControlAttribute, QVariant(false));
-    QMetaObject::invokeMethod(this, "readyRead", Qt::QueuedConnection);
-    QMetaObject::invokeMethod(this, "finished", Qt::QueuedConnection);
+    if (content.isEmpty()) setError(ContentNotFoundError, tr("Image %1 not found.").arg(url().fragment()));
+    QMetaObject::invokeMethod(this, "deliver", Qt::QueuedConnection);
+}
+
+qint64 FbImageReply::bytesAvailable() const
+{
+    return end - offset + QNetworkReply::bytesAvailable();
+}
+
+void FbImageReply::deliver()
+{
+    emit metaDataChanged();
+    if (error() != NoError) {
+        emit QNetworkReply::error(error());
+    } else {
+        emit downloadProgress(end - offset, end - offset);
+        emit readyRead();
+    }
+    emit finished();
 }
 
 qint64 FbImageReply::readData(char *data, qint64 maxSize)
 {
-    if (offset >= content.size()) return -1;
-    QMetaObject::invokeMethod(this, "readyRead", Qt::QueuedConnection);
-    qint64 number = qMin(maxSize, content.size() - offset);
+    if (offset >= end) return -1;
+    qint64 number = qMin(maxSize, end - offset);
     memcpy(data, content.constData() + offset, number);
     offset += number;
     return number;
 }
 
+//---------------------------------------------------------------------------
+//  FbRenditionTask
+//---------------------------------------------------------------------------
+
+QString FbRenditionTask::folder()
+{
+    static const QString folder = QStandardPaths::writableLocation(QStandardPaths::CacheLocation) + "/renditions";
+    return folder;
+}
+
+// A lazy binary is known by its place in the book file, so that its copy is
+// found without decoding it.
+QString FbRenditionTask::path(const FbBinary &file, int width)
+{
+    QByteArray key = file.hash();
+    if (!file.isLoaded()) {
+        key = FbHash::hash(QString("%1\n%2\n%3\n%4").arg(file.source(), QString::number(file.offset()),
+            QString::number(file.length()), QString::number(file.modified().toMSecsSinceEpoch())).toUtf8());
+    }
+    return QString("%1/%2-%3").arg(folder()).arg(QString::fromLatin1(key.toHex())).arg(width);
+}
+
+// A copy read from the cache is touched, so that it is pruned last.
+QByteArray FbRenditionTask::cached(const QString &path)
+{
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly)) return QByteArray();
+#if QT_VERSION >= QT_VERSION_CHECK(5, 10, 0)
+    file.setFileTime(QDateTime::currentDateTime(), QFileDevice::FileModificationTime);
+#endif
+    return file.readAll();
+}
+
+// The limit is set in megabytes. The folder is listed when the first copy
+// is added and then only when the running total goes over the limit; it is
+// pruned to three quarters of the limit, so that it is not listed again for
+// every new copy.
+void FbRenditionTask::prune(qint64 added)
+{
+    static QMutex mutex;
+    static qint64 total = -1;
+    QMutexLocker locker(&mutex);
+    Q_UNUSED(locker);
+    qint64 limit = QSettings().value("renditionCache", 256).toLongLong() * 1024 * 1024;
+    if (total >= 0) total += added;
+    if (total >= 0 && total <= limit) return;
+
+    // The newest copies are kept, everything past the first that does not fit goes.
+    total = 0;
+    bool full = false;
+    const QFileInfoList list = QDir(folder()).entryInfoList(QDir::Files, QDir::Time);
+    for (const QFileInfo &info: list) {
+        full = full || total + info.size() > limit / 4 * 3;
+        if (full) QFile::remove(info.filePath()); else total += info.size();
+    }
+}
+
+FbRenditionTask::FbRenditionTask(const QByteArray &data, const QStringList &paths, int width)
+    : m_data(data)
+    , m_paths(paths)
+    , m_width(width)
+{
+    setAutoDelete(false);
+}
+
+void FbRenditionTask::run()
+{
+    emit ready(render());
+    deleteLater();
+}
+
+QByteArray FbRenditionTask::render()
+{
+    QBuffer buffer(const_cast<QByteArray*>(&m_data));
+    QImageReader reader(&buffer);
+    const QByteArray format = reader.format();
+    QSize size = reader.size();
+    if (size.width() > m_width) {
+        // Scaled decoding lets JPEG skip most of the work at full resolution.
+        reader.setScaledSize(size.scaled(m_width, size.height(), Qt::KeepAspectRatio));
+    }
+    QImage image = reader.read();
+    if (image.isNull()) return m_data;
+
+    QByteArray result;
+    QBuffer output(&result);
+    output.open(QIODevice::WriteOnly);
+    bool jpeg = format == "jpeg" && !image.hasAlphaChannel();
+    if (!image.save(&output, jpeg ? "JPEG" : "PNG", jpeg ? 90 : -1)) return m_data;
+
+    QDir().mkpath(folder());
+    for (const QString &path: m_paths) {
+        QSaveFile file(path);
+        if (file.open(QIODevice::WriteOnly) && file.write(result) == result.size() && file.commit()) prune(result.size());
+    }
+    return result;
+}
+
 //---------------------------------------------------------------------------
 //  FbNetworkAccessManager
 //
 //    http://doc.trolltech.com/qq/32/qq32-webkit-protocols.html
 //---------------------------------------------------------------------------
 
+// Managers belong to the pages of the windows, so the list of them is
+// neither locked nor used anywhere but on the GUI thread.
+static QList<FbNetworkAccessManager*> & managers()
+{
+    Q_ASSERT(QThread::currentThread() == QCoreApplication::instance()->thread());
+    static QList<FbNetworkAccessManager*> list;
+    return list;
+}
+
 FbNetworkAccessManager::FbNetworkAccessManager(QObject *parent)
     : QNetworkAccessManager(parent)
     , m_store(new FbStore(this))
+    , m_width(QSettings().value("imageWidth", 1280).toInt())
+{
+    managers().append(this);
+}
+
+FbNetworkAccessManager::~FbNetworkAccessManager()
+{
+    managers().removeOne(this);
+}
+
+// Finds the store of the document open under the given path in any window.
+FbStore * FbNetworkAccessManager::store(const QString &path)
 {
+    for (FbNetworkAccessManager *manager: managers()) {
+        if (manager->m_store && manager->m_path == path) return manager->m_store;
+    }
+    return 0;
+}
+
+FbBinary * FbNetworkAccessManager::binary(const QUrl &url)
+{
+    if (url.scheme() != "fb2") return 0;
+    FbStore *store = FbNetworkAccessManager::store(url.path());
+    return store ? store->get(url.fragment()) : 0;
 }
 
 void FbNetworkAccessManager::setStore(const QUrl url, FbStore *store)
@@ -231,26 +938,63 @@ void FbNetworkAccessManager::setStore(const QUrl url, FbStore *store)
 
 QNetworkReply * FbNetworkAccessManager::createRequest(Operation op, const QNetworkRequest &request, QIODevice *outgoingData)
 {
-    if (m_store) {
-        const QUrl &url = request.url();
+    const QUrl &url = request.url();
+    if (url.scheme() == "fb2") {
+        // Images pasted from another window still point to their own document.
         const QString path = url.path();
-        if (url.scheme() == "fb2" && path == m_path) {
-            QString name = request.url().fragment();
-            QByteArray data = m_store->data(name);
-            return new FbImageReply(op, request, data);
+        FbStore *store = path == m_path ? m_store : FbNetworkAccessManager::store(path);
+        if (store) {
+            QString name = url.fragment();
+            FbBinary *file = store->get(name);
+            if (m_width > 0 && file) {
+                if (!file->isLoaded() && file->info().width == 0) file->probe();
+                if (file->info().width > m_width) return rendition(op, request, store, file);
+            }
+            return new FbImageReply(op, request, store->data(name));
         }
     }
     return QNetworkAccessManager::createRequest(op, request, outgoingData);
 }
 
+// Images wider than the display width are shown from a downscaled copy that
+// is read from the disk cache or made by the thread pool on the first use.
+// The original is read only to make the copy.
+QNetworkReply * FbNetworkAccessManager::rendition(Operation op, const QNetworkRequest &request, FbStore *store, FbBinary *file)
+{
+    const QString path = FbRenditionTask::path(*file, m_width);
+
+    QByteArray scaled = FbRenditionTask::cached(path);
+    if (!scaled.isEmpty()) return new FbImageReply(op, request, scaled);
+
+    QByteArray data = store->data(file->name());
+    if (data.isEmpty()) return new FbImageReply(op, request, data);
+
+    // Once loaded, the binary is known by its content, which is where the
+    // copy is looked for from now on; it is kept under both names.
+    QStringList paths(path);
+    const QString loaded = FbRenditionTask::path(*file, m_width);
+    if (loaded != path) {
+        scaled = FbRenditionTask::cached(loaded);
+        if (!scaled.isEmpty()) return new FbImageReply(op, request, scaled);
+        paths.append(loaded);
+    }
+
+    FbImageReply *reply = new FbImageReply(op, request);
+    FbRenditionTask *task = new FbRenditionTask(data, paths, m_width);
+    connect(task, SIGNAL(ready(QByteArray)), reply, SLOT(setContent(QByteArray)));
+    QThreadPool::globalInstance()->start(task);
+    return reply;
+}
+
 QVariant FbNetworkAccessManager::info(int row, int col) const
 {
     if (!m_store) return QVariant();
     if (0 <= row && row < count()) {
-        FbBinary *file = m_store->at(row);
+        const FbBinaryInfo &info = m_store->at(row)->info();
         switch (col) {
-            case 2: return file->type();
-            case 3: return file->size();
+            case 2: return info.type;
+            case 3: return info.size;
+            case 4: return info.width ? QString("%1x%2").arg(info.width).arg(info.height) : QString();
         }
         return m_store->at(row)->name();
     }
@@ -261,7 +1005,7 @@ QByteArray FbNetworkAccessManager::data(int index) const
 {
     if (!m_store) return QByteArray();
     if (0 <= index && index < count()) {
-        return m_store->at(index)->data();
+        return m_store->data(m_store->at(index)->name());
     }
     return QByteArray();
 }
@@ -451,7 +1195,7 @@ FbImgsModel::FbImgsModel(FbTextEdit *text, QObject *parent)
 int FbImgsModel::columnCount(const QModelIndex &parent) const
 {
     Q_UNUSED(parent);
-    return 4;
+    return 5;
 }
 
 int FbImgsModel::rowCount(const QModelIndex &parent) const
@@ -466,6 +1210,7 @@ QVariant FbImgsModel::headerData(int section, Qt::Orientation orientation, int r
             case 1: return tr("File name");
             case 2: return tr("Type");
             case 3: return tr("Size");
+            case 4: return tr("Dimensions");
         }
     }
     return QVariant();
@@ -481,6 +1226,7 @@ QVariant FbImgsModel::data(const QModelIndex &index, int role) const
             case Qt::TextAlignmentRole: {
                 switch (index.column()) {
                     case 3: return Qt::AlignRight;
+                    case 4: return Qt::AlignRight;
                     default: return Qt::AlignLeft;
                 }
             }
@@ -531,6 +1277,7 @@ void FbImgsWidget::loadFinished()
     m_list->resizeColumnToContents(1);
     m_list->resizeColumnToContents(2);
     m_list->resizeColumnToContents(3);
+    m_list->resizeColumnToContents(4);
     m_list->setColumnHidden(0, true);
 }
 
@@ -2,14 +2,22 @@
 #define FB2IMGS_H
 
 #include <QByteArray>
+#include <QCache>
 #include <QDialog>
 #include <QComboBox>
+#include <QDateTime>
+#include <QHash>
 #include <QLabel>
 #include <QLineEdit>
 #include <QList>
+#include <QMutex>
+#include <QScopedPointer>
+#include <QVector>
 #include <QNetworkAccessManager>
 #include <QNetworkReply>
+#include <QRunnable>
 #include <QString>
+#include <QStringList>
 #include <QTemporaryFile>
 #include <QToolButton>
 #include <QTreeView>
@@ -20,25 +28,114 @@ class FbTextEdit;
 
 class FbNetworkAccessManager;
 
-class FbBinary : public QTemporaryFile
+// Append-only temporary file shared by all binaries of the process. Binaries
+// are addressed by index, removed ones leave garbage that is compacted away.
+// Entries are counted references keyed by hash, so every distinct content is
+// kept once whatever number of documents use it. Small binaries stay in
+// memory as long as all of them fit into the resident limit. A binary too big
+// to be decoded in memory is streamed into a segment file of its own, so that
+// writers never wait for each other; the segment is kept as it is.
+class FbBinaryPack
 {
-    Q_OBJECT
 public:
-    static QString md5(const QByteArray &data);
+    static FbBinaryPack & instance();
+    int append(const QByteArray &data, const QByteArray &hash = QByteArray());
+    QTemporaryFile * begin();
+    int commit(QTemporaryFile *segment, const QByteArray &hash);
+    void cancel(QTemporaryFile *segment);
+    int acquire(int index);
+    QByteArray read(int index);
+    qint64 read(int index, qint64 offset, char *data, qint64 maxSize);
+    void remove(int index);
+private:
+    FbBinaryPack();
+    ~FbBinaryPack();
+    Q_DISABLE_COPY(FbBinaryPack)
+    bool openFile();
+    void remap();
+    void compact();
+private:
+    enum { CompactSize = 16 * 1024 * 1024 };
+    struct Entry { qint64 offset; qint64 length; int refs; QByteArray hash; QByteArray data; QTemporaryFile *segment; uchar *map; };
+    int insert(const Entry &entry);
+    const uchar * address(int index);
+    QMutex m_mutex;
+    QScopedPointer<QTemporaryFile> m_file;
+    QVector<Entry> m_entries;
+    QHash<QByteArray, int> m_hashes;
+    QVector<int> m_unused;
+    uchar *m_map;
+    qint64 m_mapped;
+    qint64 m_size;
+    qint64 m_garbage;
+    qint64 m_resident;
+    qint64 m_threshold;
+    qint64 m_limit;
+};
+
+// What is known of a binary without decoding it all, filled in once from
+// the content-type attribute and the image header.
+struct FbBinaryInfo
+{
+    FbBinaryInfo() : width(0), height(0), size(0) {}
+    QString type;
+    int width;
+    int height;
+    qint64 size;
+    QByteArray hash;
+};
+
+// Decoded data is collected while the binary is open for writing and goes
+// into the pack when it is finished. Data too big to be collected is
+// streamed into a pack segment as it comes, with only the header kept to
+// find the image format and size.
+class FbBinary : public QIODevice
+{
+    Q_OBJECT
 public:
     explicit FbBinary(const QString &name);
-    inline qint64 write(QByteArray &data);
-    void setHash(const QString &hash) { m_hash = hash; }
-    const QString & hash() const { return m_hash; }
+    virtual ~FbBinary();
+    bool open(OpenMode mode);
+    qint64 write(const QByteArray &data);
+    void finish();
+    void share(FbBinary &file);
+    void setSource(const QString &path, const QDateTime &modified, qint64 offset, qint64 length, const QString &type, const char *data = 0);
+    const QString & source() const { return m_source; }
+    const QDateTime & modified() const { return m_modified; }
+    qint64 offset() const { return m_offset; }
+    qint64 length() const { return m_length; }
+    bool isLoaded() const { return m_source.isEmpty(); }
+    bool load();
+    bool probe();
+    void setHash(const QByteArray &hash) { m_info.hash = hash; }
+    const QByteArray & hash() const { return m_info.hash; }
+    void setType(const QString &type);
+    const QString & type() const { return m_info.type; }
     const QString & name() const { return m_name; }
-    const QString & type() const { return m_type; }
-    qint64 size() const { return m_size; }
+    qint64 size() const { return m_info.size; }
+    const FbBinaryInfo & info() const { return m_info; }
     QByteArray data();
+signals:
+    void loaded(FbBinary *file);
+protected:
+    qint64 readData(char *data, qint64 maxSize);
+    qint64 writeData(const char *data, qint64 maxSize);
+private:
+    void sniff(QByteArray &data);
 private:
+    enum { HeaderSize = 64 * 1024, SniffSize = 1024, StreamSize = 4 * 1024 * 1024 };
     const QString m_name;
-    QString m_hash;
-    QString m_type;
-    qint64 m_size;
+    FbBinaryInfo m_info;
+    QString m_source;
+    QDateTime m_modified;
+    qint64 m_offset;
+    qint64 m_length;
+    qint64 m_written;
+    QByteArray m_buffer;
+    QByteArray m_head;
+    QTemporaryFile *m_stream;
+    int m_index;
+    bool m_sniffed;
 };
 
 typedef QList<FbBinary*> FbBinatyList;
@@ -50,18 +147,38 @@ public:
     explicit FbStore(QObject *parent);
     virtual ~FbStore();
     QString add(const QString &path, QByteArray &data);
+    QString add(FbBinary *file);
     bool exists(const QString &name) const;
     FbBinary * get(const QString &name) const;
-    const QString & set(const QString &name, QByteArray data, const QString &hash = QString());
-    QString name(const QString &hash) const;
+    const QByteArray & set(const QString &name, QByteArray data, const QByteArray &hash = QByteArray());
+    QString name(const QByteArray &hash) const;
     QByteArray data(const QString &name) const;
+    void detach(const QString &filename);
+    void setCacheSize(qint64 bytes);
+    qint64 cacheHits() const { return m_hits; }
+    qint64 cacheMisses() const { return m_misses; }
+signals:
+    void changed(FbBinary *file);
 public slots:
-    void binary(const QString &name, const QByteArray &data);
+    void binary(FbBinary *file);
+private slots:
+    void indexHash(FbBinary *file);
 public:
     inline FbBinary * at(int i) const { return FbBinatyList::at(i); }
     inline int count() const { return FbBinatyList::count(); }
 private:
+    typedef QHash<QString, FbBinary*> BinaryHash;
+    typedef QMultiHash<QByteArray, FbBinary*> BinaryDigest;
     QString newName(const QString &path);
+    void index(FbBinary *file);
+    void unindex(FbBinary *file);
+    void loadSimilar(qint64 size);
+private:
+    BinaryHash m_names;
+    BinaryDigest m_hashes;
+    mutable QCache<QString, QByteArray> m_cache;
+    mutable qint64 m_hits;
+    mutable qint64 m_misses;
 };
 
 typedef QListIterator<FbBinary*> FbTemporaryIterator;
@@ -84,8 +201,12 @@ class FbNetworkAccessManager : public QNetworkAccessManager
 
 public:
     explicit FbNetworkAccessManager(QObject *parent = 0);
+    virtual ~FbNetworkAccessManager();
     void setStore(const QUrl url, FbStore *store);
     FbStore *store() const { return m_store; }
+    // Look through the documents of all windows, on the GUI thread only.
+    static FbStore *store(const QString &path);
+    static FbBinary *binary(const QUrl &url);
 
 public:
     QString add(const QString &path, QByteArray &data) { return m_store->add(path, data); }
@@ -98,9 +219,13 @@ public:
 protected:
     virtual QNetworkReply *createRequest(Operation op, const QNetworkRequest &request, QIODevice *outgoingData = 0);
 
+private:
+    QNetworkReply *rendition(Operation op, const QNetworkRequest &request, FbStore *store, FbBinary *file);
+
 private:
     FbStore *m_store;
     QString m_path;
+    int m_width;
 };
 
 class FbImageReply : public QNetworkReply
@@ -108,16 +233,50 @@ class FbImageReply : public QNetworkReply
     Q_OBJECT
 public:
     explicit FbImageReply(QNetworkAccessManager::Operation op, const QNetworkRequest &request, const QByteArray &data);
-    qint64 bytesAvailable() const { return content.size(); }
+    explicit FbImageReply(QNetworkAccessManager::Operation op, const QNetworkRequest &request);
+    qint64 bytesAvailable() const;
     bool isSequential() const { return true; }
     void abort() { close(); }
 
+public slots:
+    void setContent(const QByteArray &data);
+
 protected:
     qint64 readData(char *data, qint64 maxSize);
 
+private slots:
+    void deliver();
+
 private:
     QByteArray content;
     qint64 offset;
+    qint64 end;
+};
+
+// Downscaled copy of an image for display, kept on disk by hash and width;
+// a binary not loaded yet is known by its place in the book. The original
+// binary is never touched, so it is saved unchanged. The task
+// is deleted by the thread that made it, once its result is posted there.
+// The disk cache is kept under a size limit by removing the copies used
+// least recently.
+class FbRenditionTask : public QObject, public QRunnable
+{
+    Q_OBJECT
+public:
+    static QString path(const FbBinary &file, int width);
+    static QByteArray cached(const QString &path);
+    explicit FbRenditionTask(const QByteArray &data, const QStringList &paths, int width);
+    void run();
+signals:
+    void ready(const QByteArray &data);
+private:
+    static QString folder();
+    static void prune(qint64 added);
+    QByteArray render();
+private:
+    const QByteArray m_data;
+    const QStringList m_paths;
+    const int m_width;
 };
 
 class FbComboCtrl : public QLineEdit
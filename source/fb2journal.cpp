@@ -0,0 +1,445 @@
+#include "fb2journal.hpp"
+
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QSaveFile>
+#include <QSettings>
+#include <QStandardPaths>
+#include <QTextStream>
+#include <QUndoStack>
+#include <QUuid>
+#include <QWebFrame>
+#include <QtDebug>
+
+#include "fb2dock.hpp"
+#include "fb2hash.h"
+#include "fb2html.h"
+#include "fb2imgs.hpp"
+#include "fb2page.hpp"
+#include "fb2text.hpp"
+#include "fb2utils.h"
+
+//---------------------------------------------------------------------------
+//  FbJournalWriter
+//---------------------------------------------------------------------------
+
+FbJournalWriter::FbJournalWriter(const QString &path)
+    : QObject()
+    , m_path(path)
+    , m_catalogSet(false)
+    , m_infoSet(false)
+    , m_modified(false)
+{
+    setAutoDelete(false);
+}
+
+void FbJournalWriter::addUnit(const QString &key, const QString &records)
+{
+    m_units.append(Unit(key, records));
+}
+
+void FbJournalWriter::setSkeleton(const QString &records, const QStringList &removed)
+{
+    m_skeleton = records;
+    m_removed = removed;
+}
+
+void FbJournalWriter::addBinary(const QString &hex, const QByteArray &data)
+{
+    m_binaries.append(Binary(hex, data));
+}
+
+void FbJournalWriter::setCatalog(const QStringList &catalog)
+{
+    m_catalog = catalog;
+    m_catalogSet = true;
+}
+
+void FbJournalWriter::setInfo(const QString &source, bool modified)
+{
+    m_source = source;
+    m_modified = modified;
+    m_infoSet = true;
+}
+
+void FbJournalWriter::run()
+{
+    for (const Unit &unit: m_units) write("units/" + unit.first, unit.second.toUtf8());
+
+    if (!m_skeleton.isEmpty() && write("skeleton", m_skeleton.toUtf8())) {
+        for (const QString &key: m_removed) QFile::remove(m_path + "/units/" + key);
+    }
+
+    for (const Binary &binary: m_binaries) {
+        if (write("binaries/" + binary.first, binary.second)) continue;
+        const QString prefix = binary.first + '\t';
+        QMutableStringListIterator it(m_catalog);
+        while (it.hasNext()) if (it.next().startsWith(prefix)) it.remove();
+        emit failed(binary.first);
+    }
+    if (m_catalogSet) write("catalog", m_catalog.join('\n').toUtf8());
+
+    if (m_infoSet) {
+        QSettings info(m_path + "/info", QSettings::IniFormat);
+        info.setValue("source", m_source);
+        info.setValue("modified", m_modified);
+        info.sync();
+    }
+    deleteLater();
+}
+
+bool FbJournalWriter::write(const QString &name, const QByteArray &data)
+{
+    QSaveFile file(m_path + "/" + name);
+    if (file.open(QFile::WriteOnly) && file.write(data) == data.size() && file.commit()) return true;
+    qCritical() << tr("Cannot write journal %1: %2.").arg(file.fileName()).arg(file.errorString());
+    return false;
+}
+
+//---------------------------------------------------------------------------
+//  FbJournal
+//---------------------------------------------------------------------------
+
+// One thread writes the checkpoints, so they reach the folder in order.
+FbJournal::FbJournal(FbMainDock *dock)
+    : QObject(dock)
+    , m_dock(dock)
+    , m_modified(false)
+{
+    m_pool.setMaxThreadCount(1);
+    m_timer.setInterval(Interval);
+    m_timer.setSingleShot(true);
+    connect(&m_timer, SIGNAL(timeout()), SLOT(checkpoint()));
+    connect(dock->text(), SIGNAL(loadFinished(bool)), SLOT(connectPage()));
+    connectPage();
+}
+
+// The folder outlives the window unless the book was saved or given up:
+// a journal left modified is offered for recovery on the next start.
+FbJournal::~FbJournal()
+{
+    m_pool.waitForDone();
+    if (!m_lock) return;
+    m_lock->unlock();
+    if (!m_modified) QDir(m_path).removeRecursively();
+}
+
+QString FbJournal::folder()
+{
+    return QStandardPaths::writableLocation(QStandardPaths::AppDataLocation) + "/journal";
+}
+
+QStringList FbJournal::orphans()
+{
+    QStringList result;
+    QDir dir(folder());
+    for (const QString &name: dir.entryList(QDir::Dirs | QDir::NoDotAndDotDot)) {
+        const QString path = dir.filePath(name);
+        QLockFile lock(path + "/lock");
+        lock.setStaleLockTime(0);
+        if (!lock.tryLock(0)) continue;
+        lock.unlock();
+        if (QSettings(path + "/info", QSettings::IniFormat).value("modified").toBool()) {
+            result << path;
+        } else {
+            discard(path);
+        }
+    }
+    return result;
+}
+
+QString FbJournal::source(const QString &path)
+{
+    return QSettings(path + "/info", QSettings::IniFormat).value("source").toString();
+}
+
+void FbJournal::discard(const QString &path)
+{
+    QDir(path).removeRecursively();
+}
+
+// The page is told to write everything again, so that a journal started
+// later for the same page holds the whole book.
+void FbJournal::discard()
+{
+    m_timer.stop();
+    m_modified = false;
+    if (!m_lock) return;
+    m_pool.waitForDone();
+    m_lock->unlock();
+    m_lock.reset();
+    discard(m_path);
+    m_dock->text()->page()->mainFrame()->evaluateJavaScript("if (window.fbUnits) fbUnits.restart();");
+    m_path.clear();
+    m_units.clear();
+    m_binaries.clear();
+    m_catalog.clear();
+    if (m_store) {
+        m_dirty.clear();
+        for (int i = 0; i < m_store->count(); ++i) m_dirty.insert(m_store->at(i)->name());
+    }
+}
+
+void FbJournal::setSource(const QString &filename)
+{
+    m_source = filename;
+    if (m_lock) writeInfo();
+}
+
+void FbJournal::connectPage()
+{
+    FbTextPage *page = m_dock->text()->page();
+    connect(page->undoStack(), SIGNAL(indexChanged(int)), SLOT(schedule()), Qt::UniqueConnection);
+    connect(page->undoStack(), SIGNAL(cleanChanged(bool)), SLOT(schedule()), Qt::UniqueConnection);
+
+    // A new store is listed once, after that only its changes are.
+    FbStore *store = m_dock->text()->store();
+    if (store && store != m_store) {
+        m_store = store;
+        connect(store, SIGNAL(changed(FbBinary*)), SLOT(binaryChanged(FbBinary*)));
+        m_catalog.clear();
+        m_dirty.clear();
+        for (int i = 0; i < store->count(); ++i) m_dirty.insert(store->at(i)->name());
+    }
+
+    page->mainFrame()->evaluateJavaScript(jScript("units.js"));
+
+    // The recovered book is written to the new journal before the old one goes.
+    if (!m_recovered.isEmpty() && !page->isLoading()) {
+        checkpoint();
+        m_pool.waitForDone();
+        discard(m_recovered);
+        m_recovered.clear();
+    }
+}
+
+void FbJournal::schedule()
+{
+    if (!m_timer.isActive()) m_timer.start();
+}
+
+void FbJournal::binaryChanged(FbBinary *file)
+{
+    if (sender() == m_store) m_dirty.insert(file->name());
+}
+
+// The binaries that refer to a copy not written are tried again.
+void FbJournal::binaryFailed(const QString &hex)
+{
+    m_binaries.remove(QByteArray::fromHex(hex.toLatin1()));
+    const QString prefix = hex + '\t';
+    QMutableMapIterator<QString, QString> it(m_catalog);
+    while (it.hasNext()) {
+        it.next();
+        if (!it.value().startsWith(prefix)) continue;
+        m_dirty.insert(it.key());
+        it.remove();
+    }
+    schedule();
+}
+
+void FbJournal::checkpoint()
+{
+    FbTextPage *page = m_dock->text()->page();
+    if (page->isLoading()) return;
+
+    // Nothing is written until the book is changed for the first time.
+    bool modified = m_dock->isModified();
+    if (!modified && !m_lock) return;
+    if (!create()) return;
+
+    FbJournalWriter *writer = new FbJournalWriter(m_path);
+    QVariant result = page->mainFrame()->evaluateJavaScript("fbUnits.checkpoint();");
+    QVariantList list = result.toList();
+    if (!list.isEmpty()) writeUnits(*writer, list);
+    writeBinaries(*writer);
+    m_modified = modified;
+    writer->setInfo(m_source, m_modified);
+    start(writer);
+}
+
+void FbJournal::start(FbJournalWriter *writer)
+{
+    connect(writer, SIGNAL(failed(QString)), SLOT(binaryFailed(QString)));
+    m_pool.start(writer);
+}
+
+bool FbJournal::create()
+{
+    if (m_lock) return true;
+    const QString path = folder() + "/" + QUuid::createUuid().toString().mid(1, 36);
+    if (!QDir().mkpath(path)) return false;
+    QScopedPointer<QLockFile> lock(new QLockFile(path + "/lock"));
+    lock->setStaleLockTime(0);
+    if (!lock->tryLock(0) || !QDir().mkpath(path + "/units") || !QDir().mkpath(path + "/binaries")) {
+        qCritical() << tr("Cannot create journal %1.").arg(path);
+        return false;
+    }
+    m_path = path;
+    m_lock.swap(lock);
+    return true;
+}
+
+// The units the new skeleton does not refer to any more are removed.
+void FbJournal::writeUnits(FbJournalWriter &writer, const QVariantList &list)
+{
+    for (int i = 1; i + 1 < list.size(); i += 2) {
+        const QString key = list.at(i).toString();
+        writer.addUnit(key, list.at(i + 1).toString());
+        m_units.insert(key);
+    }
+
+    const QString skeleton = list.at(0).toString();
+    if (skeleton.isEmpty()) return;
+
+    QSet<QString> keys;
+    FbRecordReader reader(skeleton);
+    while (reader.next()) {
+        if (reader.op() == 'R') keys.insert(QString(reader.text().constData(), reader.text().size()));
+    }
+    QStringList removed;
+    QMutableSetIterator<QString> it(m_units);
+    while (it.hasNext()) {
+        const QString &key = it.next();
+        if (keys.contains(key)) continue;
+        removed << key;
+        it.remove();
+    }
+    writer.setSkeleton(skeleton, removed);
+}
+
+void FbJournal::writeBinaries(FbJournalWriter &writer)
+{
+    if (m_dirty.isEmpty() || !m_store) return;
+
+    for (const QString &name: m_dirty) {
+        FbBinary *file = m_store->get(name);
+        if (file) m_catalog.insert(name, entry(writer, file)); else m_catalog.remove(name);
+    }
+    m_dirty.clear();
+    writer.setCatalog(m_catalog.values());
+}
+
+// A binary still read from the book file is recorded by its byte range and
+// the time the file was modified, any other one by the hash of its copy.
+QString FbJournal::entry(FbJournalWriter &writer, FbBinary *file)
+{
+    const QString line = file->type() + '\t' + file->name();
+    if (!file->isLoaded()) {
+        return '\t' + line
+            + '\t' + file->source()
+            + '\t' + QString::number(file->offset())
+            + '\t' + QString::number(file->length())
+            + '\t' + QString::number(file->modified().toMSecsSinceEpoch());
+    }
+
+    QByteArray data;
+    QByteArray hash = file->hash();
+    if (hash.isEmpty()) hash = FbHash::hash(data = file->data());
+    const QString hex = QString::fromLatin1(hash.toHex());
+    if (!m_binaries.contains(hash)) {
+        if (data.isEmpty()) data = file->data();
+        writer.addBinary(hex, data);
+        m_binaries.insert(hash);
+    }
+    return hex + '\t' + line;
+}
+
+void FbJournal::writeInfo()
+{
+    FbJournalWriter *writer = new FbJournalWriter(m_path);
+    writer->setInfo(m_source, m_modified);
+    start(writer);
+}
+
+bool FbJournal::restore(const QString &path)
+{
+    QFile skeleton(path + "/skeleton");
+    if (!skeleton.open(QFile::ReadOnly)) return false;
+    QString html;
+    if (!FbJournal::html(path, QString::fromUtf8(skeleton.readAll()), html)) {
+        qCritical() << tr("Cannot recover the book from journal %1.").arg(path);
+        return false;
+    }
+
+    FbStore *store = new FbStore(0);
+    QFile catalog(path + "/catalog");
+    if (catalog.open(QFile::ReadOnly | QFile::Text)) {
+        QTextStream in(&catalog);
+        in.setCodec("UTF-8");
+        while (!in.atEnd()) {
+            const QStringList fields = in.readLine().split('\t');
+            if (fields.size() == 7) {
+                restore(store, fields);
+                continue;
+            }
+            if (fields.size() != 3) continue;
+            QFile file(path + "/binaries/" + fields.at(0));
+            if (!file.open(QFile::ReadOnly)) continue;
+            store->set(fields.at(2), file.readAll(), QByteArray::fromHex(fields.at(0).toLatin1()));
+            store->get(fields.at(2))->setType(fields.at(1));
+        }
+    }
+
+    FbTextPage *page = m_dock->text()->page();
+    page->html(html, store);
+    page->complete();
+    m_recovered = path;
+    return true;
+}
+
+// A binary recorded by reference is read from the book file again, as long
+// as that file was not changed since.
+void FbJournal::restore(FbStore *store, const QStringList &fields)
+{
+    const QString &name = fields.at(2);
+    const QString &source = fields.at(3);
+    const QDateTime modified = QFileInfo(source).lastModified();
+    if (modified.toMSecsSinceEpoch() != fields.at(6).toLongLong()) {
+        qCritical() << tr("File %1 was changed, cannot recover image %2.").arg(source).arg(name);
+        return;
+    }
+    FbBinary *file = new FbBinary(name);
+    file->setSource(source, modified, fields.at(4).toLongLong(), fields.at(5).toLongLong(), fields.at(1));
+    store->binary(file);
+}
+
+// Turns the records back into the markup of the page, with the references
+// replaced by the units they point to.
+bool FbJournal::html(const QString &path, const QString &records, QString &html)
+{
+    static const QStringList empty = QStringList()
+        << "AREA" << "BASE" << "BR" << "COL" << "EMBED" << "HR" << "IMG"
+        << "INPUT" << "LINK" << "META" << "PARAM" << "SOURCE" << "WBR";
+
+    QString name;
+    QString atts;
+    bool raw = false;
+    FbRecordReader reader(records);
+    while (reader.next()) {
+        const QString &text = reader.text();
+        switch (reader.op()) {
+            case 'A': name = QString(text.constData(), text.size()); break;
+            case 'V': atts += ' ' + name + "=\"" + text.toHtmlEscaped() + '"'; break;
+            case 'N': {
+                html += '<' + text + atts + '>';
+                atts.clear();
+                raw = text.compare("SCRIPT", Qt::CaseInsensitive) == 0 || text.compare("STYLE", Qt::CaseInsensitive) == 0;
+            } break;
+            case 'T': html += raw ? text : text.toHtmlEscaped(); break;
+            case 'C': html += "<!--" + text + "-->"; break;
+            case 'E': {
+                if (!empty.contains(text, Qt::CaseInsensitive)) html += "</" + text + '>';
+                raw = false;
+            } break;
+            case 'R': {
+                QFile file(path + "/units/" + text);
+                if (!file.open(QFile::ReadOnly)) return false;
+                if (!FbJournal::html(path, QString::fromUtf8(file.readAll()), html)) return false;
+            } break;
+            default: return false;
+        }
+    }
+    return !reader.hasError();
+}
@@ -0,0 +1,123 @@
+#ifndef FB2JOURNAL_H
+#define FB2JOURNAL_H
+
+#include <QByteArray>
+#include <QLockFile>
+#include <QMap>
+#include <QObject>
+#include <QPair>
+#include <QPointer>
+#include <QRunnable>
+#include <QScopedPointer>
+#include <QSet>
+#include <QString>
+#include <QStringList>
+#include <QThreadPool>
+#include <QTimer>
+#include <QVariant>
+
+class FbBinary;
+class FbMainDock;
+class FbStore;
+
+// Files of one checkpoint, written into the journal folder by the thread of
+// the journal. Units go first, so the skeleton never refers to a unit not
+// written yet, and the units it does not refer to any more are removed
+// after it. A binary that cannot be written is left out of the catalog.
+class FbJournalWriter : public QObject, public QRunnable
+{
+    Q_OBJECT
+
+public:
+    explicit FbJournalWriter(const QString &path);
+    void addUnit(const QString &key, const QString &records);
+    void setSkeleton(const QString &records, const QStringList &removed);
+    void addBinary(const QString &hex, const QByteArray &data);
+    void setCatalog(const QStringList &catalog);
+    void setInfo(const QString &source, bool modified);
+    void run();
+
+signals:
+    void failed(const QString &hex);
+
+private:
+    bool write(const QString &name, const QByteArray &data);
+
+private:
+    typedef QPair<QString, QString> Unit;
+    typedef QPair<QString, QByteArray> Binary;
+    const QString m_path;
+    QList<Unit> m_units;
+    QString m_skeleton;
+    QStringList m_removed;
+    QList<Binary> m_binaries;
+    QStringList m_catalog;
+    QString m_source;
+    bool m_catalogSet;
+    bool m_infoSet;
+    bool m_modified;
+};
+
+// Journal of the edited book, kept so that the work survives a crash. Every
+// few seconds after an edit the top-level units changed since the previous
+// checkpoint are written, with the skeleton that joins them if it changed.
+// Binaries still read from the book file are recorded by reference, other
+// ones are written once by hash, and only those added since the previous
+// checkpoint are looked at. What is written is collected on the GUI thread
+// and the files are written by a worker. The folder is removed once the book
+// is saved or its changes are discarded, so any folder left unlocked belongs
+// to a session that did not end that way.
+class FbJournal : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit FbJournal(FbMainDock *dock);
+    virtual ~FbJournal();
+    void setSource(const QString &filename);
+    bool restore(const QString &path);
+
+public:
+    static QStringList orphans();
+    static QString source(const QString &path);
+    static void discard(const QString &path);
+
+public slots:
+    void checkpoint();
+    void discard();
+
+private slots:
+    void connectPage();
+    void schedule();
+    void binaryChanged(FbBinary *file);
+    void binaryFailed(const QString &hex);
+
+private:
+    static QString folder();
+    static bool html(const QString &path, const QString &records, QString &html);
+    static void restore(FbStore *store, const QStringList &fields);
+    bool create();
+    void start(FbJournalWriter *writer);
+    void writeUnits(FbJournalWriter &writer, const QVariantList &list);
+    void writeBinaries(FbJournalWriter &writer);
+    void writeInfo();
+    QString entry(FbJournalWriter &writer, FbBinary *file);
+
+private:
+    enum { Interval = 3000 };
+    FbMainDock *m_dock;
+    QString m_path;
+    QString m_source;
+    QString m_recovered;
+    QScopedPointer<QLockFile> m_lock;
+    QThreadPool m_pool;
+    QTimer m_timer;
+    QSet<QString> m_units;
+    QSet<QByteArray> m_binaries;
+    QSet<QString> m_dirty;
+    QMap<QString, QString> m_catalog;
+    QPointer<FbStore> m_store;
+    bool m_modified;
+};
+
+#endif // FB2JOURNAL_H
@@ -13,6 +13,9 @@
 #include "fb2code.hpp"
 #include "fb2dlgs.hpp"
 #include "fb2dock.hpp"
+#include "fb2imgs.hpp"
+#include "fb2journal.hpp"
+#include "fb2page.hpp"
 #include "fb2logs.hpp"
 #include "fb2save.hpp"
 #include "fb2text.hpp"
@@ -22,13 +25,13 @@
 //  FbMainWindow
 //---------------------------------------------------------------------------
 
-FbMainWindow::FbMainWindow(const QString &filename, ViewMode mode)
+FbMainWindow::FbMainWindow(const QString &filename, ViewMode mode, const QString &journal)
     : QMainWindow()
     , noteEdit(0)
     , toolEdit(0)
     , logDock(0)
     , isSwitched(false)
-    , isUntitled(true)
+    , isUntitled(filename.isEmpty())
 {
     Q_UNUSED(mode);
     connect(qApp, SIGNAL(logMessage(QtMsgType, QString)), SLOT(logMessage(QtMsgType, QString)));
@@ -49,7 +52,11 @@ FbMainWindow::FbMainWindow(const QString &filename, ViewMode mode)
 
     mainDock->setMode(Fb::Text);
     setCurrentFile(filename);
-    mainDock->load(filepath);
+    if (!journal.isEmpty() && mainDock->recover(journal)) {
+        textChanged(true);
+    } else {
+        mainDock->load(filepath);
+    }
 }
 
 void FbMainWindow::warning(int row, int col, const QString &msg)
@@ -90,12 +97,26 @@ void FbMainWindow::logDestroyed()
 
 void FbMainWindow::closeEvent(QCloseEvent *event)
 {
-    if (maybeSave()) {
-        writeSettings();
-        event->accept();
-    } else {
+    if (!maybeSave()) {
         event->ignore();
+        return;
+    }
+
+    // The window stays open unless the save in progress is committed; its
+    // result is delivered right away, so a failure is shown before returning.
+    if (m_saving) {
+        FbSaveThread *thread = m_saving;
+        thread->wait();
+        QCoreApplication::sendPostedEvents(mainDock, QEvent::MetaCall);
+        QCoreApplication::sendPostedEvents(this, QEvent::MetaCall);
+        if (!thread->isCommitted()) {
+            event->ignore();
+            return;
+        }
     }
+
+    writeSettings();
+    event->accept();
 }
 
 void FbMainWindow::fileNew()
@@ -571,19 +592,47 @@ bool FbMainWindow::maybeSave()
         else if (ret == QMessageBox::Cancel)
             return false;
     }
+    mainDock->journal()->discard();
     return true;
 }
 
 bool FbMainWindow::saveFile(const QString &fileName, const QString &codec)
 {
-    QFile file(fileName);
-    if (!file.open(QFile::WriteOnly | QFile::Text)) {
-        QMessageBox::warning(this, qApp->applicationName(), tr("Cannot write file %1: %2.").arg(fileName).arg(file.errorString()));
+    if (mainDock->text()->page()->isLoading()) {
+        QMessageBox::warning(this, qApp->applicationName(), tr("The book is still loading."));
+        return false;
+    }
+    if (m_saving) {
+        QMessageBox::warning(this, qApp->applicationName(), tr("The book is still being saved."));
         return false;
     }
-    bool ok = mainDock->save(&file, codec);
-    setCurrentFile(fileName);
-    return ok;
+    // Images that are still read from the original file must be loaded before it is overwritten.
+    if (FbStore *store = mainDock->text()->store()) store->detach(fileName);
+    m_saving = mainDock->save(fileName, codec);
+    if (!m_saving) return false;
+    connect(m_saving, SIGNAL(progress(int)), SLOT(saveProgress(int)));
+    connect(m_saving, SIGNAL(done(bool,QString)), SLOT(saveDone(bool,QString)));
+    m_saving->start();
+    return true;
+}
+
+void FbMainWindow::saveProgress(int percent)
+{
+    statusBar()->showMessage(tr("Saving... %1%").arg(percent));
+}
+
+void FbMainWindow::saveDone(bool ok, const QString &error)
+{
+    FbSaveThread *thread = qobject_cast<FbSaveThread*>(sender());
+    if (!thread) return;
+    if (ok) {
+        setCurrentFile(thread->filename());
+        textChanged(mainDock->isModified());
+        statusBar()->showMessage(tr("Saved"), 2000);
+    } else {
+        statusBar()->clearMessage();
+        QMessageBox::warning(this, qApp->applicationName(), tr("Cannot write file %1: %2.").arg(thread->filename()).arg(error));
+    }
 }
 
 void FbMainWindow::setCurrentFile(const QString &filename)
@@ -596,6 +645,7 @@ void FbMainWindow::setCurrentFile(const QString &filename)
         curFile = info.canonicalFilePath();
     }
     setWindowFilePath(curFile);
+    mainDock->journal()->setSource(curFile);
     textChanged(false);
 }
 
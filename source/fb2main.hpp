@@ -4,6 +4,7 @@
 #include <QMainWindow>
 #include <QDockWidget>
 #include <QListView>
+#include <QPointer>
 #include <QXmlParseException>
 
 QT_BEGIN_NAMESPACE
@@ -20,6 +21,8 @@ class FbLogDock;
 
 class FbMainDock;
 
+class FbSaveThread;
+
 #include "fb2logs.hpp"
 
 class FbMainWindow : public QMainWindow
@@ -28,7 +31,7 @@ class FbMainWindow : public QMainWindow
 
 public:
     enum ViewMode { FB2, XML };
-    explicit FbMainWindow(const QString &filename = QString(), ViewMode mode = FB2);
+    explicit FbMainWindow(const QString &filename = QString(), ViewMode mode = FB2, const QString &journal = QString());
 
 protected:
     void closeEvent(QCloseEvent *event);
@@ -52,6 +55,8 @@ private slots:
     void about();
     void textChanged(bool modified);
     void logDestroyed();
+    void saveProgress(int percent);
+    void saveDone(bool ok, const QString &error);
 
     void openSettings();
 
@@ -72,6 +77,7 @@ private:
     FbMainWindow *findFbMainWindow(const QString &fileName);
 
     FbMainDock *mainDock;
+    QPointer<FbSaveThread> m_saving;
     QTextEdit *noteEdit;
     QToolBar *toolEdit;
     FbLogDock *logDock;
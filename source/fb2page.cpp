@@ -27,6 +27,10 @@ void FbTextLogger::trace(const QString &text)
 FbTextPage::FbTextPage(QObject *parent)
     : QWebPage(parent)
     , m_logger(this)
+    , m_cache(new FbSaveCache)
+    , m_ready(false)
+    , m_loading(false)
+    , m_complete(false)
 {
     QWebSettings *s = settings();
     s->setAttribute(QWebSettings::AutoLoadImages, true);
@@ -43,11 +47,16 @@ FbTextPage::FbTextPage(QObject *parent)
 
     setContentEditable(true);
     setNetworkAccessManager(new FbNetworkAccessManager(this));
+    connect(this, SIGNAL(loadStarted()), SLOT(loadStarted()));
     connect(this, SIGNAL(loadFinished(bool)), SLOT(loadFinished()));
     connect(this, SIGNAL(contentsChanged()), SLOT(fixContents()));
     connect(this, SIGNAL(selectionChanged()), SLOT(showStatus()));
 }
 
+FbTextPage::~FbTextPage()
+{
+}
+
 QUrl FbTextPage::getStyleSheetUrl()
 {
     QFile file(":style.css");
@@ -84,8 +93,34 @@ void FbTextPage::html(const QString &html, FbStore *store)
     QWebSettings::clearMemoryCaches();
     QUrl url = FbTextPage::createUrl();
     manager()->setStore(url, store);
+    m_chunks.clear();
+    m_loading = true;
+    m_complete = false;
+    setContentEditable(false);
     mainFrame()->setHtml(html, url);
+    emit status(tr("Loading..."));
+}
 
+void FbTextPage::append(const QString &html, bool nested)
+{
+    if (!m_ready) {
+        m_chunks.append(qMakePair(html, nested));
+        return;
+    }
+    FbTextElement parent = body();
+    if (nested) parent = parent.lastChild();
+    parent.appendInside(html);
+}
+
+void FbTextPage::complete()
+{
+    m_complete = true;
+    if (!m_ready) return;
+    m_loading = false;
+    setContentEditable(true);
+    // Let the views rebuild their contents with the appended sections.
+    emit loadFinished(true);
+    showStatus();
 }
 
 bool FbTextPage::acceptNavigationRequest(QWebFrame *frame, const QNetworkRequest &request, NavigationType type)
@@ -393,15 +428,36 @@ QString FbTextPage::location()
 
 void FbTextPage::showStatus()
 {
+    if (m_loading) {
+        emit status(tr("Loading..."));
+        return;
+    }
+
     QString javascript = jScript("get_status.js");
     QString text = mainFrame()->evaluateJavaScript(javascript).toString();
     text.replace("FB:", "");
     emit status(text);
 }
 
+void FbTextPage::loadStarted()
+{
+    m_ready = false;
+    m_cache->clear();
+}
+
 void FbTextPage::loadFinished()
 {
+    if (m_ready) return;
+    m_ready = true;
     mainFrame()->addToJavaScriptWindowObject("logger", &m_logger);
+    while (!m_chunks.isEmpty()) {
+        QPair<QString, bool> chunk = m_chunks.takeFirst();
+        append(chunk.first, chunk.second);
+    }
+    if (m_complete) {
+        m_loading = false;
+        setContentEditable(true);
+    }
     body().select();
 }
 
@@ -2,9 +2,11 @@
 #define FB2PAGE_HPP
 
 #include <QAction>
+#include <QScopedPointer>
 #include <QUndoCommand>
 #include <QWebPage>
 
+class FbSaveCache;
 class FbStore;
 class FbTextElement;
 class FbNetworkAccessManager;
@@ -30,9 +32,12 @@ class FbTextPage : public QWebPage
 
 public:
     explicit FbTextPage(QObject *parent = 0);
+    virtual ~FbTextPage();
     FbNetworkAccessManager *manager();
     bool read(const QString &html);
     bool read(QIODevice *device);
+    bool isLoading() const { return m_loading; }
+    FbSaveCache * cache() const { return m_cache.data(); }
     void push(QUndoCommand * command, const QString &text = QString());
     FbTextElement element(const QString &location);
     FbTextElement current();
@@ -54,6 +59,8 @@ signals:
 
 public slots:
     void html(const QString &html, FbStore *store);
+    void append(const QString &html, bool nested);
+    void complete();
     void insertBody();
     void insertTitle();
     void insertAnnot();
@@ -80,6 +87,7 @@ protected:
     void update();
 
 private slots:
+    void loadStarted();
     void loadFinished();
     void fixContents();
     void showStatus();
@@ -91,6 +99,11 @@ private:
     FbActionMap m_actions;
     FbTextLogger m_logger;
     QString m_html;
+    QList<QPair<QString, bool> > m_chunks;
+    QScopedPointer<FbSaveCache> m_cache;
+    bool m_ready;
+    bool m_loading;
+    bool m_complete;
 };
 
 #endif // FB2PAGE_HPP
@@ -1,5 +1,11 @@
 #include "fb2read.hpp"
 
+#include <QCoreApplication>
+#include <QFile>
+#include <QFileInfo>
+#include <QSettings>
+#include <QTextCodec>
+#include <QThreadPool>
 #include <QtDebug>
 
 #include "fb2imgs.hpp"
@@ -13,6 +19,8 @@ void FbReadThread::execute(QObject *parent, QString *source, QIODevice *device)
 {
     FbReadThread *thread = new FbReadThread(parent, source, device);
     connect(thread, SIGNAL(html(QString, FbStore*)), parent, SLOT(html(QString, FbStore*)));
+    connect(thread, SIGNAL(append(QString, bool)), parent, SLOT(append(QString, bool)));
+    connect(thread, SIGNAL(complete()), parent, SLOT(complete()));
     thread->start();
 }
 
@@ -20,8 +28,13 @@ FbReadThread::FbReadThread(QObject *parent, QString *source, QIODevice *device)
     : QThread(parent)
     , m_device(device)
     , m_source(source)
+    , m_painted(false)
 {
     m_store = new FbStore(this);
+    if (QFile *file = qobject_cast<QFile*>(device)) {
+        QString filename = file->fileName();
+        if (!filename.startsWith(':') && QSettings().value("lazyBinaries", true).toBool()) m_lazyFile = filename;
+    }
 }
 
 FbReadThread::~FbReadThread()
@@ -32,20 +45,30 @@ FbReadThread::~FbReadThread()
 
 void FbReadThread::run()
 {
-    if (parse()) {
-        emit html(m_html, m_store);
-    } else {
-        delete m_store;
+    bool ok = parse();
+    if (!m_painted) {
+        if (ok) emit html(m_html, m_store); else delete m_store;
     }
+    if (ok || m_painted) emit complete();
     deleteLater();
 }
 
+void FbReadThread::progress(const QString &html, bool nested)
+{
+    if (m_painted) {
+        emit append(html, nested);
+    } else {
+        m_painted = true;
+        emit this->html(html, m_store);
+    }
+}
+
 bool FbReadThread::parse()
 {
     QXmlStreamWriter writer(&m_html);
-    FbReadHandler handler(writer);
+    FbReadHandler handler(writer, QThreadPool::globalInstance());
 
-    connect(&handler, SIGNAL(binary(QString,QByteArray)), m_store, SLOT(binary(QString,QByteArray)));
+    connect(&handler, SIGNAL(binary(FbBinary*)), m_store, SLOT(binary(FbBinary*)));
     connect(&handler, SIGNAL(warning(int,int,QString)), parent(), SIGNAL(warning(int,int,QString)));
     connect(&handler, SIGNAL(error(int,int,QString)), parent(), SIGNAL(error(int,int,QString)));
     connect(&handler, SIGNAL(fatal(int,int,QString)), parent(), SIGNAL(fatal(int,int,QString)));
@@ -57,6 +80,13 @@ bool FbReadThread::parse()
     reader.setErrorHandler(&handler);
 
     if (m_device) {
+        // Binaries are indexed by byte offset, that needs an ASCII-compatible encoding.
+        if (!m_lazyFile.isEmpty() && !m_device->peek(4).contains('\0')) handler.setLazyFile(m_lazyFile);
+        // Big books are shown as soon as the first section is converted.
+        if (m_device->size() > ProgressiveSize) {
+            handler.setProgressive(&m_html);
+            connect(&handler, SIGNAL(progress(QString,bool)), this, SLOT(progress(QString,bool)), Qt::DirectConnection);
+        }
         return reader.parse(m_device);
     } else {
         return reader.parse(m_source);
@@ -129,8 +159,14 @@ FbReadHandler::RootHandler::RootHandler(FbReadHandler &owner, const QString &nam
 FbXmlHandler::NodeHandler * FbReadHandler::RootHandler::NewTag(const QString &name, const QXmlStreamAttributes &atts)
 {
     switch (toKeyword(name)) {
-        case Binary: return new BinaryHandler(m_owner, name, atts);
+        case Binary: {
+            m_owner.flush(false, true);
+            if (m_owner.m_lazyFile.isEmpty()) return new BinaryHandler(m_owner, name, atts);
+            m_owner.scanBinaries();
+            return NULL;
+        }
         case Style: return new StyleHandler(m_owner, name, m_style);
+        case Body: m_owner.m_body = true; break;
         default: ;
     }
 
@@ -145,6 +181,7 @@ FbXmlHandler::NodeHandler * FbReadHandler::RootHandler::NewTag(const QString &na
 void FbReadHandler::RootHandler::EndTag(const QString &name)
 {
     Q_UNUSED(name);
+    m_owner.flush(false, true);
     if (!m_head) writer().writeEndElement();
 }
 
@@ -224,6 +261,7 @@ FbReadHandler::TextHandler::TextHandler(FbReadHandler &owner, const QString &nam
     , m_tag(tag)
     , m_empty(true)
 {
+    m_owner.m_top = tag;
     Init(name, atts);
 }
 
@@ -291,6 +329,11 @@ void FbReadHandler::TextHandler::EndTag(const QString &name)
         }
     }
     writer().writeEndElement();
+    if (!m_parent) {
+        m_owner.endTop();
+    } else if (!m_parent->m_parent) {
+        m_owner.flush(true);
+    }
 }
 
 bool FbReadHandler::TextHandler::isNotes() const
@@ -299,25 +342,105 @@ bool FbReadHandler::TextHandler::isNotes() const
     return m_parent ? m_parent->isNotes() : false;
 }
 
+//---------------------------------------------------------------------------
+//  FbReadHandler::BinaryDecoder
+//---------------------------------------------------------------------------
+
+static FbBinary * createBinary(const QString &name, const QString &type)
+{
+    FbBinary *file = new FbBinary(name);
+    file->setType(type);
+    file->open(QIODevice::WriteOnly);
+    return file;
+}
+
+FbReadHandler::BinaryDecoder::BinaryDecoder(const QString &name, const QString &type)
+    : m_file(createBinary(name, type))
+    , m_decoder(m_file, &m_hash)
+{
+}
+
+FbReadHandler::BinaryDecoder::~BinaryDecoder()
+{
+    if (m_file) delete m_file;
+}
+
+FbBinary * FbReadHandler::BinaryDecoder::finish()
+{
+    FbBinary *file = m_file;
+    m_file = 0;
+    if (!file) return 0;
+    if (!m_decoder.finish()) {
+        qCritical() << QObject::tr("Cannot write temporary file for %1: %2.").arg(file->name()).arg(file->errorString());
+        delete file;
+        return 0;
+    }
+    file->setHash(m_hash.result());
+    file->finish();
+    return file;
+}
+
 //---------------------------------------------------------------------------
 //  FbReadHandler::BinaryHandler
 //---------------------------------------------------------------------------
 
+// Payloads up to this size are handed to the thread pool as a whole,
+// larger ones are decoded by the parser thread as they arrive.
+static const int MaxTaskSize = 4 * 1024 * 1024;
+
 FbReadHandler::BinaryHandler::BinaryHandler(FbReadHandler &owner, const QString &name, const QXmlStreamAttributes &atts)
     : BaseHandler(owner, name)
     , m_file(Value(atts, "id"))
+    , m_type(Value(atts, "content-type"))
 {
+    if (!m_file.isEmpty() && !m_owner.m_pool) m_decoder.reset(new BinaryDecoder(m_file, m_type));
 }
 
 void FbReadHandler::BinaryHandler::TxtTag(const QString &text)
 {
-    m_text += text;
+    if (m_file.isEmpty()) return;
+    if (m_decoder) {
+        m_decoder->append(text);
+        return;
+    }
+    m_data += text.toLatin1();
+    if (m_data.size() > MaxTaskSize) {
+        m_decoder.reset(new BinaryDecoder(m_file, m_type));
+        m_decoder->append(m_data);
+        m_data.clear();
+    }
 }
 
 void FbReadHandler::BinaryHandler::EndTag(const QString &name)
 {
     Q_UNUSED(name);
-    if (!m_file.isEmpty()) m_owner.addFile(m_file, QByteArray::fromBase64(m_text.toUtf8()));
+    if (m_decoder) {
+        if (FbBinary *file = m_decoder->finish()) m_owner.addFile(file);
+    } else if (!m_file.isEmpty()) {
+        m_owner.addTask(m_file, m_type, m_data);
+        m_data.clear();
+    }
+}
+
+//---------------------------------------------------------------------------
+//  FbReadHandler::BinaryTask
+//---------------------------------------------------------------------------
+
+FbReadHandler::BinaryTask::BinaryTask(FbReadHandler &owner, const QString &name, const QString &type, const QByteArray &data)
+    : QRunnable()
+    , m_owner(owner)
+    , m_name(name)
+    , m_type(type)
+    , m_data(data)
+{
+}
+
+void FbReadHandler::BinaryTask::run()
+{
+    BinaryDecoder decoder(m_name, m_type);
+    decoder.append(m_data);
+    if (FbBinary *file = decoder.finish()) m_owner.addFile(file);
+    m_owner.m_tasks.release();
 }
 
 //---------------------------------------------------------------------------
@@ -329,7 +452,7 @@ bool FbReadHandler::load(QObject *page, QString &source, QString &html)
     QXmlStreamWriter writer(&html);
     FbReadHandler handler(writer);
 
-    connect(&handler, SIGNAL(binary(QString,QByteArray)), page, SLOT(binary(QString,QByteArray)));
+    connect(&handler, SIGNAL(binary(FbBinary*)), page, SLOT(binary(FbBinary*)));
 
     XML2::XmlReader reader;
 
@@ -340,10 +463,19 @@ bool FbReadHandler::load(QObject *page, QString &source, QString &html)
     return reader.parse(source);
 }
 
-FbReadHandler::FbReadHandler(QXmlStreamWriter &writer)
+FbReadHandler::FbReadHandler(QXmlStreamWriter &writer, QThreadPool *pool)
     : FbXmlHandler()
     , m_writer(writer)
-{
+    , m_pool(pool)
+    , m_target(QCoreApplication::instance()->thread())
+    , m_capacity(pool ? 2 * pool->maxThreadCount() : 0)
+    , m_html(0)
+    , m_closed(-1)
+    , m_body(false)
+    , m_nested(false)
+    , m_painted(false)
+{
+    m_tasks.release(m_capacity);
     m_writer.setAutoFormatting(true);
     m_writer.setAutoFormattingIndent(2);
     m_writer.writeStartElement("html");
@@ -351,7 +483,9 @@ FbReadHandler::FbReadHandler(QXmlStreamWriter &writer)
 
 FbReadHandler::~FbReadHandler()
 {
-    m_writer.writeEndElement();
+    // Wait until every binary handed to the pool is decoded and emitted.
+    m_tasks.acquire(m_capacity);
+    m_writer.writeEndDocument();
 }
 
 FbXmlHandler::NodeHandler * FbReadHandler::CreateRoot(const QString &name, const QXmlStreamAttributes &atts)
@@ -368,7 +502,200 @@ bool FbReadHandler::comment(const QString& ch)
     return true;
 }
 
-void FbReadHandler::addFile(const QString &name, const QByteArray &data)
+void FbReadHandler::addFile(FbBinary *file)
+{
+    // The parser runs in a worker thread, but binaries are owned by a store
+    // living in the target thread, the main one unless it is set otherwise.
+    file->moveToThread(m_target);
+    emit binary(file);
+}
+
+// Emits the converted text, cut right after a closed element: the first call
+// gives the head of the page, every next one gives the elements to append
+// either into the last top-level element (nested) or after it.
+void FbReadHandler::flush(bool nested, bool force)
+{
+    if (!m_html || !m_body) return;
+    if (!m_painted) {
+        if (force) return;
+        m_painted = true;
+        emit progress(*m_html, false);
+    } else {
+        if (!force && m_html->size() < ChunkSize) return;
+        int end = m_nested ? (m_closed < 0 ? m_html->size() : m_closed) : 0;
+        if (end > 0) emit progress(m_html->left(end), true);
+        if (end < m_html->size()) {
+            QString tail = m_html->mid(end);
+            if (nested) tail += QString("</%1>").arg(m_top);
+            emit progress(tail, false);
+        }
+    }
+    m_html->truncate(0);
+    m_nested = nested;
+    m_closed = -1;
+}
+
+void FbReadHandler::endTop()
+{
+    if (m_html && m_nested && m_closed < 0) m_closed = m_html->size();
+    flush(false);
+}
+
+static int tagEnd(const QByteArray &data, int pos)
+{
+    char quote = 0;
+    for (int i = pos; i < data.size(); ++i) {
+        char ch = data.at(i);
+        if (quote) {
+            if (ch == quote) quote = 0;
+        } else if (ch == '"' || ch == '\'') {
+            quote = ch;
+        } else if (ch == '>') {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static QByteArray tagValue(const QByteArray &tag, const QByteArray &name)
+{
+    int pos = 0;
+    while (true) {
+        int eq = tag.indexOf('=', pos);
+        if (eq < 0) break;
+        int open = eq + 1;
+        while (open < tag.size() && isspace(uchar(tag.at(open)))) ++open;
+        if (open >= tag.size()) break;
+        char quote = tag.at(open);
+        if (quote != '"' && quote != '\'') break;
+        int close = tag.indexOf(quote, open + 1);
+        if (close < 0) break;
+        if (tag.mid(pos, eq - pos).trimmed().toLower() == name) return tag.mid(open + 1, close - open - 1);
+        pos = close + 1;
+    }
+    return QByteArray();
+}
+
+// Replaces the predefined entities and the character references.
+static QString unescape(const QString &text)
+{
+    if (!text.contains('&')) return text;
+    QString result;
+    result.reserve(text.size());
+    for (int i = 0; i < text.size(); ++i) {
+        const QChar ch = text.at(i);
+        int end = ch == '&' ? text.indexOf(';', i + 1) : -1;
+        if (end < 0) {
+            result += ch;
+            continue;
+        }
+        const QStringRef ref = text.midRef(i + 1, end - i - 1);
+        if (ref == QLatin1String("quot")) {
+            result += '"';
+        } else if (ref == QLatin1String("apos")) {
+            result += '\'';
+        } else if (ref == QLatin1String("lt")) {
+            result += '<';
+        } else if (ref == QLatin1String("gt")) {
+            result += '>';
+        } else if (ref == QLatin1String("amp")) {
+            result += '&';
+        } else if (ref.startsWith('#')) {
+            bool ok = false;
+            uint code = ref.startsWith(QLatin1String("#x")) ? ref.mid(2).toUInt(&ok, 16) : ref.mid(1).toUInt(&ok, 10);
+            if (!ok || code == 0 || code > 0x10FFFF) {
+                result += ch;
+                continue;
+            }
+            if (QChar::requiresSurrogates(code)) {
+                result += QChar(QChar::highSurrogate(code));
+                result += QChar(QChar::lowSurrogate(code));
+            } else {
+                result += QChar(code);
+            }
+        } else {
+            result += ch;
+            continue;
+        }
+        i = end;
+    }
+    return result;
+}
+
+static QString tagAttribute(const QByteArray &tag, const QByteArray &name, QTextCodec *codec)
+{
+    return unescape(codec->toUnicode(tagValue(tag, name)));
+}
+
+// The encoding given by the XML declaration, UTF-8 when there is none.
+static QTextCodec * declaredCodec(const QByteArray &data)
+{
+    int start = data.startsWith("\xEF\xBB\xBF") ? 3 : 0;
+    int end = data.indexOf("?>", start);
+    if (end > 0 && data.mid(start, 5) == "<?xml") {
+        const QByteArray name = tagValue(data.mid(start + 5, end - start - 5), "encoding");
+        if (QTextCodec *codec = name.isEmpty() ? 0 : QTextCodec::codecForName(name)) return codec;
+    }
+    return QTextCodec::codecForName("UTF-8");
+}
+
+static int skipPast(const QByteArray &data, int pos, const char *marker)
+{
+    int end = data.indexOf(marker, pos);
+    return end < 0 ? data.size() : end + int(qstrlen(marker));
+}
+
+void FbReadHandler::scanBinaries()
+{
+    // The parser stops at the first <binary>: the rest of the file is scanned
+    // only for the byte ranges of the binaries, which are decoded on demand.
+    stop();
+
+    QFile file(m_lazyFile);
+    if (!file.open(QFile::ReadOnly)) {
+        qCritical() << QObject::tr("Cannot read file %1: %2.").arg(m_lazyFile).arg(file.errorString());
+        return;
+    }
+    XML2::XmlMappedFile mapped(&file);
+    const QByteArray &data = mapped.data();
+    const QFileInfo info(file);
+    const QString path = info.canonicalFilePath();
+    const QDateTime modified = info.lastModified();
+    QTextCodec *codec = declaredCodec(data);
+
+    int pos = 0;
+    while ((pos = data.indexOf('<', pos)) >= 0) {
+        const char *p = data.constData() + pos;
+        int rest = data.size() - pos;
+        if (rest >= 4 && qstrncmp(p, "<!--", 4) == 0) {
+            pos = skipPast(data, pos + 4, "-->");
+        } else if (rest >= 9 && qstrncmp(p, "<![CDATA[", 9) == 0) {
+            pos = skipPast(data, pos + 9, "]]>");
+        } else if (rest >= 2 && qstrncmp(p, "<?", 2) == 0) {
+            pos = skipPast(data, pos + 2, "?>");
+        } else if (rest > 7 && qstrnicmp(p, "<binary", 7) == 0 && (isspace(uchar(p[7])) || p[7] == '>' || p[7] == '/')) {
+            int end = tagEnd(data, pos + 7);
+            if (end < 0) break;
+            QByteArray tag = data.mid(pos + 7, end - pos - 7);
+            pos = end + 1;
+            if (tag.endsWith('/')) continue;
+            int stop = data.indexOf('<', pos);
+            if (stop < 0) break;
+            QString name = tagAttribute(tag, "id", codec);
+            if (!name.isEmpty()) {
+                FbBinary *binary = new FbBinary(name);
+                binary->setSource(path, modified, pos, stop - pos, tagAttribute(tag, "content-type", codec), data.constData() + pos);
+                addFile(binary);
+            }
+            pos = stop;
+        } else {
+            ++pos;
+        }
+    }
+}
+
+void FbReadHandler::addTask(const QString &name, const QString &type, const QByteArray &data)
 {
-    emit binary(name, data);
+    m_tasks.acquire();
+    m_pool->start(new BinaryTask(*this, name, type, data));
 }
@@ -1,13 +1,23 @@
 #ifndef FB2READ_H
 #define FB2READ_H
 
+#include "fb2base64.h"
+#include "fb2hash.h"
 #include "fb2xml.hpp"
 
 #include <QByteArray>
 #include <QMutex>
+#include <QRunnable>
+#include <QScopedPointer>
+#include <QSemaphore>
 #include <QThread>
 #include <QXmlDefaultHandler>
 
+QT_BEGIN_NAMESPACE
+class QThreadPool;
+QT_END_NAMESPACE
+
+class FbBinary;
 class FbStore;
 
 class FbReadThread : public QThread
@@ -21,20 +31,28 @@ public:
 signals:
     void binary(const QString &name, const QByteArray &data);
     void html(const QString &html, FbStore *store);
+    void append(const QString &html, bool nested);
+    void complete();
     void error();
 
 protected:
     void run();
 
+private slots:
+    void progress(const QString &html, bool nested);
+
 private:
     explicit FbReadThread(QObject *parent, QString *source, QIODevice *device);
     bool parse();
 
 private:
+    enum { ProgressiveSize = 1024 * 1024 };
     QIODevice *m_device;
     QString *m_source;
     FbStore *m_store;
     QString m_html;
+    QString m_lazyFile;
+    bool m_painted;
 };
 
 class FbReadHandler : public FbXmlHandler
@@ -43,10 +61,13 @@ class FbReadHandler : public FbXmlHandler
 
 public:
     static bool load(QObject *page, QString &source, QString &html);
-    explicit FbReadHandler(QXmlStreamWriter &writer);
+    explicit FbReadHandler(QXmlStreamWriter &writer, QThreadPool *pool = 0);
     virtual ~FbReadHandler();
     virtual bool comment(const QString& ch);
     QXmlStreamWriter & writer() { return m_writer; }
+    void setLazyFile(const QString &filename) { m_lazyFile = filename; }
+    void setProgressive(QString *html) { m_html = html; }
+    void setTargetThread(QThread *thread) { m_target = thread; }
 
 private:
     class BaseHandler : public NodeHandler
@@ -123,6 +144,21 @@ private:
         bool m_empty;
     };
 
+    class BinaryDecoder
+    {
+    public:
+        explicit BinaryDecoder(const QString &name, const QString &type);
+        ~BinaryDecoder();
+        void append(const QString &text) { if (m_file) m_decoder.append(text); }
+        void append(const QByteArray &text) { if (m_file) m_decoder.append(text); }
+        FbBinary * finish();
+    private:
+        Q_DISABLE_COPY(BinaryDecoder)
+        FbBinary *m_file;
+        FbHash m_hash;
+        FbBase64Decoder m_decoder;
+    };
+
     class BinaryHandler : public BaseHandler
     {
     public:
@@ -131,22 +167,53 @@ private:
         virtual void TxtTag(const QString &text);
         virtual void EndTag(const QString &name);
     private:
-        QString m_file;
-        QString m_text;
+        const QString m_file;
+        const QString m_type;
+        QByteArray m_data;
+        QScopedPointer<BinaryDecoder> m_decoder;
+    };
+
+    class BinaryTask : public QRunnable
+    {
+    public:
+        explicit BinaryTask(FbReadHandler &owner, const QString &name, const QString &type, const QByteArray &data);
+        void run();
+    private:
+        FbReadHandler &m_owner;
+        const QString m_name;
+        const QString m_type;
+        const QByteArray m_data;
     };
 
 signals:
-    void binary(const QString &name, const QByteArray &data);
+    void binary(FbBinary *file);
+    void progress(const QString &html, bool nested);
 
 protected:
     virtual NodeHandler * CreateRoot(const QString &name, const QXmlStreamAttributes &atts);
 
 private:
-    void addFile(const QString &name, const QByteArray &data);
+    void addFile(FbBinary *file);
+    void addTask(const QString &name, const QString &type, const QByteArray &data);
+    void scanBinaries();
+    void flush(bool nested, bool force = false);
+    void endTop();
 
 private:
+    enum { ChunkSize = 256 * 1024 };
     typedef QHash<QString, QString> StringHash;
     QXmlStreamWriter &m_writer;
+    QThreadPool *m_pool;
+    QThread *m_target;
+    QSemaphore m_tasks;
+    int m_capacity;
+    QString m_lazyFile;
+    QString *m_html;
+    QString m_top;
+    int m_closed;
+    bool m_body;
+    bool m_nested;
+    bool m_painted;
     StringHash m_hash;
 };
 
@@ -1,6 +1,7 @@
 #include <QtGui>
 #include <QtDebug>
 
+#include "fb2base64.h"
 #include "fb2page.hpp"
 #include "fb2save.hpp"
 #include "fb2text.hpp"
@@ -11,14 +12,17 @@
 #include <QBuffer>
 #include <QComboBox>
 #include <QDateTime>
+#include <QEventLoop>
 #include <QFileDialog>
 #include <QGridLayout>
 #include <QLabel>
 #include <QList>
 #include <QNetworkReply>
 #include <QNetworkRequest>
+#include <QSaveFile>
 #include <QScopedPointer>
 #include <QTextCodec>
+#include <QTimer>
 #include <QWebFrame>
 #include <QWebPage>
 #include <QtDebug>
@@ -116,24 +120,217 @@ void FbHtmlHandler::onAttr(const QString &name, const QString &value)
 
 void FbHtmlHandler::onNew(const QString &name)
 {
-    startElement("", local(name), name, m_atts);
+    startElement(QStringRef(&name), m_atts);
     m_atts.clear();
 }
 
 void FbHtmlHandler::onTxt(const QString &text)
 {
     m_lastTextLength = text.length();
-    characters(text);
+    characters(QStringRef(&text));
 }
 
 void FbHtmlHandler::onCom(const QString &text)
 {
-    comment(text);
+    comment(QStringRef(&text));
 }
 
 void FbHtmlHandler::onEnd(const QString &name)
 {
-    endElement("", local(name), name);
+    endElement(QStringRef(&name));
+}
+
+//---------------------------------------------------------------------------
+//  FbPrefetch
+//---------------------------------------------------------------------------
+
+FbPrefetch::FbPrefetch(QNetworkAccessManager *manager, QObject *parent)
+    : QObject(parent)
+    , m_manager(manager)
+    , m_running(0)
+    , m_waiting(0)
+    , m_parallel(Parallel)
+    , m_timeout(Timeout)
+    , m_retries(Retries)
+{
+}
+
+void FbPrefetch::start(const QList<QUrl> &urls)
+{
+    for (const QUrl &url: urls) {
+        if (m_attempts.contains(url)) continue;
+        m_attempts.insert(url, 0);
+        m_queue.append(url);
+    }
+    next();
+}
+
+bool FbPrefetch::exec(const QList<QUrl> &urls)
+{
+    QEventLoop loop;
+    connect(this, SIGNAL(finished()), &loop, SLOT(quit()));
+    start(urls);
+    if (!isFinished()) loop.exec();
+    return m_failed.isEmpty();
+}
+
+void FbPrefetch::next()
+{
+    while (m_running < m_parallel && !m_queue.isEmpty()) {
+        QNetworkRequest request(m_queue.takeFirst());
+        request.setAttribute(QNetworkRequest::FollowRedirectsAttribute, true);
+        QNetworkReply *reply = m_manager->get(request);
+        connect(reply, SIGNAL(finished()), SLOT(replyFinished()));
+        // A request that receives nothing for the whole timeout is aborted,
+        // which finishes it with an error; any progress restarts the timer.
+        QTimer *timer = new QTimer(reply);
+        timer->setSingleShot(true);
+        timer->setInterval(m_timeout);
+        connect(timer, SIGNAL(timeout()), reply, SLOT(abort()));
+        connect(reply, SIGNAL(downloadProgress(qint64,qint64)), timer, SLOT(start()));
+        timer->start();
+        ++m_running;
+    }
+    if (isFinished()) emit finished();
+}
+
+void FbPrefetch::retry()
+{
+    m_queue.append(m_delayed.takeFirst());
+    --m_waiting;
+    next();
+}
+
+void FbPrefetch::replyFinished()
+{
+    QNetworkReply *reply = qobject_cast<QNetworkReply*>(sender());
+    if (!reply) return;
+    reply->deleteLater();
+    --m_running;
+
+    const QUrl url = reply->request().url();
+    int status = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+    if (reply->error() == QNetworkReply::NoError) {
+        m_data.insert(url, reply->readAll());
+    } else if ((status < 400 || status >= 500) && m_attempts[url]++ < m_retries) {
+        m_delayed.append(url);
+        ++m_waiting;
+        QTimer::singleShot(Pause, this, SLOT(retry()));
+    } else {
+        qWarning() << tr("Cannot download image %1: %2.").arg(url.toString()).arg(reply->errorString());
+        m_failed.append(url);
+    }
+    next();
+}
+
+//---------------------------------------------------------------------------
+//  FbSaveCache
+//---------------------------------------------------------------------------
+
+const FbSaveCache::Entry * FbSaveCache::find(const QString &key) const
+{
+    QHash<QString, Entry>::const_iterator it = m_entries.constFind(key);
+    return it == m_entries.constEnd() ? 0 : &it.value();
+}
+
+// Entries that refer to binaries gone from the store are dropped, the rest
+// are listed as an object literal for units.js.
+QString FbSaveCache::versions(FbStore *store)
+{
+    QStringList list;
+    QMutableHashIterator<QString, Entry> it(m_entries);
+    while (it.hasNext()) {
+        it.next();
+        bool valid = true;
+        for (const QString &name: it.value().files) {
+            if (!store || !store->exists(name)) valid = false;
+        }
+        if (valid) {
+            list.append('"' + it.key() + "\":" + it.value().version);
+        } else {
+            it.remove();
+        }
+    }
+    return '{' + list.join(',') + '}';
+}
+
+//---------------------------------------------------------------------------
+//  FbSaveThread
+//---------------------------------------------------------------------------
+
+FbSaveSnapshot::~FbSaveSnapshot()
+{
+    for (int i = 0; i < files.size(); ++i) delete files.at(i).second;
+}
+
+FbSaveThread::FbSaveThread(QObject *parent, const QString &filename, FbSaveSnapshot *snapshot)
+    : QThread(parent)
+    , m_filename(filename)
+    , m_snapshot(snapshot)
+    , m_total(snapshot->text.size())
+    , m_written(0)
+    , m_percent(-1)
+    , m_committed(false)
+{
+    for (int i = 0; i < snapshot->files.size(); ++i) {
+        m_total += snapshot->files.at(i).second->size() / 3 * 4;
+    }
+    connect(this, SIGNAL(finished()), this, SLOT(deleteLater()));
+}
+
+FbSaveThread::~FbSaveThread()
+{
+    wait();
+}
+
+void FbSaveThread::run()
+{
+    QSaveFile file(m_filename);
+    if (!file.open(QFile::WriteOnly | QFile::Text)) {
+        emit done(false, file.errorString());
+        return;
+    }
+
+    QTextCodec *codec = QTextCodec::codecForName(m_snapshot->codec);
+    if (!codec) codec = QTextCodec::codecForName("UTF-8");
+    QScopedPointer<QTextEncoder> encoder(codec->makeEncoder(QTextCodec::IgnoreHeader));
+
+    const QString &text = m_snapshot->text;
+    bool ok = true;
+    int pos = 0;
+    for (int i = 0; ok && i < m_snapshot->files.size(); ++i) {
+        const QPair<int, FbBinary*> &part = m_snapshot->files.at(i);
+        ok = write(file, *encoder, QString::fromRawData(text.constData() + pos, part.first - pos));
+        pos = part.first;
+        FbBinary *binary = part.second;
+        if (!ok || !binary->open(QIODevice::ReadOnly)) continue;
+        FbBase64Encoder base64(binary, m_snapshot->wrap);
+        while (ok && base64.next()) ok = write(file, *encoder, base64.text());
+        binary->close();
+    }
+    if (ok) ok = write(file, *encoder, QString::fromRawData(text.constData() + pos, text.size() - pos));
+
+    if (ok) ok = file.commit(); else file.cancelWriting();
+    m_committed = ok;
+    emit done(ok, ok ? QString() : file.errorString());
+}
+
+bool FbSaveThread::write(QSaveFile &file, QTextEncoder &encoder, const QString &text)
+{
+    for (int pos = 0; pos < text.size(); pos += ChunkSize) {
+        int size = qMin<int>(ChunkSize, text.size() - pos);
+        QByteArray data = encoder.fromUnicode(text.constData() + pos, size);
+        if (file.write(data) != data.size()) return false;
+        step(size);
+    }
+    return true;
+}
+
+void FbSaveThread::step(qint64 size)
+{
+    m_written += size;
+    int percent = int(qMin<qint64>(100, m_written * 100 / qMax<qint64>(m_total, 1)));
+    if (percent != m_percent) emit progress(m_percent = percent);
 }
 
 //---------------------------------------------------------------------------
@@ -144,6 +341,9 @@ FbSaveWriter::FbSaveWriter(FbTextEdit &view, QByteArray *array)
     : QXmlStreamWriter(array)
     , m_view(view)
     , m_string(0)
+    , m_snapshot(0)
+    , m_cache(0)
+    , m_unitStart(-1)
     , m_anchor(0)
     , m_focus(0)
 {
@@ -159,6 +359,9 @@ FbSaveWriter::FbSaveWriter(FbTextEdit &view, QIODevice *device)
     : QXmlStreamWriter(device)
     , m_view(view)
     , m_string(0)
+    , m_snapshot(0)
+    , m_cache(0)
+    , m_unitStart(-1)
     , m_anchor(0)
     , m_focus(0)
 {
@@ -171,11 +374,32 @@ FbSaveWriter::FbSaveWriter(FbTextEdit &view, QString *string)
     : QXmlStreamWriter(string)
     , m_view(view)
     , m_string(string)
+    , m_snapshot(0)
+    , m_cache(0)
+    , m_unitStart(-1)
     , m_anchor(0)
     , m_focus(0)
 {
 #ifdef XMLAutoFormatting
     setAutoFormatting(true);
+    m_cache = view.page()->cache();
+#endif
+}
+
+FbSaveWriter::FbSaveWriter(FbTextEdit &view, FbSaveSnapshot *snapshot)
+    : QXmlStreamWriter(&snapshot->text)
+    , m_view(view)
+    , m_string(&snapshot->text)
+    , m_snapshot(snapshot)
+    , m_cache(0)
+    , m_unitStart(-1)
+    , m_anchor(0)
+    , m_focus(0)
+{
+#ifdef XMLAutoFormatting
+    setAutoFormatting(true);
+    snapshot->wrap = false;
+    m_cache = view.page()->cache();
 #endif
 }
 
@@ -190,6 +414,8 @@ void FbSaveWriter::writeStartDocument()
 {
     if (device()) {
         QXmlStreamWriter::writeStartDocument();
+    } else if (m_snapshot) {
+        m_string->append(QString("<?xml version=\"1.0\" encoding=\"%1\"?>").arg(QString::fromLatin1(m_snapshot->codec)));
     } else if (m_string) {
         m_string->append("<?xml version=\"1.0\" encoding=\"UTF-8\"?>");
     }
@@ -203,6 +429,10 @@ void FbSaveWriter::writeStartElement(const QString &name, int level)
     for (int i = 1; i < level; ++i) writeCharacters("  ");
 #endif
     QXmlStreamWriter::writeStartElement(name);
+    if (m_unitStart < 0 && !m_unitKey.isEmpty()) {
+        m_unitStart = m_string->length() - name.length() - 1;
+        m_unit.name = name;
+    }
 }
 
 void FbSaveWriter::writeEndElement(int level)
@@ -238,12 +468,46 @@ QByteArray FbSaveWriter::downloadFile(const QUrl &url)
 
 QString FbSaveWriter::append(const QString &name)
 {
+    if (!m_unitKey.isEmpty()) m_unit.files.append(name);
     if (m_names.indexOf(name) < 0) {
         m_names.append(name);
     }
     return name;
 }
 
+// External images are downloaded all together before the tree is written,
+// so that writing never waits for the network.
+void FbSaveWriter::prefetch(const QStringList &paths)
+{
+    FbStore *store = m_view.store();
+    if (!store) return;
+
+    QList<QUrl> urls;
+    for (const QString &path: paths) {
+        if (path.left(1) == "#") continue;
+        QUrl url = path;
+        if (m_fetched.contains(url) || FbNetworkAccessManager::binary(url)) continue;
+        urls.append(url);
+    }
+    if (urls.isEmpty()) return;
+
+    emit m_view.page()->status(QObject::tr("Downloading images..."));
+    FbPrefetch prefetch(m_view.page()->networkAccessManager());
+    prefetch.exec(urls);
+    for (const QUrl &url: urls) {
+        QByteArray data = prefetch.data(url);
+        m_fetched.insert(url, data.size() ? store->add(url.path(), data) : QString());
+    }
+
+    // The book is saved anyway, with these images left out of it.
+    const QList<QUrl> &failed = prefetch.failed();
+    if (failed.isEmpty()) return;
+    QStringList list;
+    for (const QUrl &url: failed) list << url.toString();
+    qCritical() << QObject::tr("Cannot download %n image(s), they are not saved in the book: %1.", 0, failed.size()).arg(list.join(", "));
+    emit m_view.page()->status(QObject::tr("Cannot download %n image(s).", 0, failed.size()));
+}
+
 QString FbSaveWriter::filename(const QString &path)
 {
     FbStore *store = m_view.store();
@@ -258,6 +522,15 @@ QString FbSaveWriter::filename(const QString &path)
         }
     } else {
         QUrl url = path;
+        // An image of another open document is shared, not copied.
+        if (FbBinary *file = FbNetworkAccessManager::binary(url)) {
+            return append(store->add(file));
+        }
+        // The images that could not be prefetched are not tried once more.
+        if (m_fetched.contains(url)) {
+            QString name = m_fetched.value(url);
+            return name.isEmpty() ? name : append(name);
+        }
         QByteArray data = downloadFile(url);
         if (data.size() == 0) return QString();
         QString name = store->add(url.path(), data);
@@ -298,36 +571,39 @@ void FbSaveWriter::writeFiles()
         if (!file) continue;
         writeStartElement("binary", 2);
         writeAttribute("id", name);
-        QByteArray array = file->data();
-        QString data = array.toBase64();
-        writeContentType(name, array);
+        writeContentType(file);
         writeLineEnd();
-        int pos = 0;
-        while (true) {
-            QString text = data.mid(pos, 76);
-            if (text.isEmpty()) break;
-            writeCharacters(text);
-            writeLineEnd();
-            pos += 76;
+        if (m_snapshot) {
+            // Empty characters close the start tag, the data goes right after it.
+            writeCharacters(QString());
+            FbBinary *copy = new FbBinary(name);
+            copy->share(*file);
+            m_snapshot->files.append(qMakePair(m_string->length(), copy));
+        } else if (file->open(QIODevice::ReadOnly)) {
+            // Lines are broken where writeLineEnd() would break them.
+#ifdef XMLAutoFormatting
+            FbBase64Encoder encoder(file, false);
+#else
+            FbBase64Encoder encoder(file, true);
+#endif
+            while (encoder.next()) writeCharacters(encoder.text());
+            file->close();
         }
         writeCharacters("  ");
         QXmlStreamWriter::writeEndElement();
     }
 }
 
-void FbSaveWriter::writeContentType(const QString &name, QByteArray &data)
+void FbSaveWriter::writeContentType(FbBinary *file)
 {
-    QBuffer buffer(&data);
-    buffer.open(QIODevice::ReadOnly);
-    QString type = QImageReader::imageFormat(&buffer);
+    const QString &type = file->type();
 #ifdef ImgTypePrint
     qCritical()<<"Img type: "<< type;
 #endif
     if (type.isEmpty()) {
-        qCritical() << QObject::tr("Unknown image format: %1").arg(name);
+        qCritical() << QObject::tr("Unknown image format: %1").arg(file->name());
         return;
     }
-    type.prepend("image/");
     writeAttribute("content-type", type);
 }
 
@@ -341,6 +617,46 @@ void FbSaveWriter::setFocus(int offset)
     if (m_string) m_focus = m_string->length() + offset;
 }
 
+// The unit is kept from its first tag, the indent before it belongs to the
+// place where it is spliced.
+void FbSaveWriter::beginUnit(const QString &id)
+{
+    m_unitKey = id;
+    m_unitStart = -1;
+    m_unit = FbSaveCache::Entry();
+}
+
+void FbSaveWriter::endUnit()
+{
+    // After text the writer would not indent the next tag, so only the
+    // units that end with a tag can be spliced.
+    int pos = m_unitKey.lastIndexOf(':');
+    if (m_cache && m_unitStart >= 0 && pos > 0 && m_string->endsWith('>')) {
+        m_unit.version = m_unitKey.mid(pos + 1);
+        m_unit.text = m_string->mid(m_unitStart);
+        m_cache->insert(m_unitKey.left(pos), m_unit);
+    }
+    m_unitKey.clear();
+    m_unitStart = -1;
+    m_unit = FbSaveCache::Entry();
+}
+
+// An empty tag of the same name, written and taken back, leaves the indent
+// in place and the writer in the state that the unit itself would leave.
+// This holds with auto formatting only: otherwise the indent of the parent
+// end tag depends on the handlers, which the spliced unit bypasses.
+bool FbSaveWriter::splice(const QString &key)
+{
+    const FbSaveCache::Entry *entry = m_cache ? m_cache->find(key) : 0;
+    if (!entry) return false;
+    QXmlStreamWriter::writeStartElement(entry->name);
+    QXmlStreamWriter::writeEndElement();
+    m_string->chop(entry->name.length() + 3);
+    m_string->append(entry->text);
+    for (const QString &name: entry->files) append(name);
+    return true;
+}
+
 //---------------------------------------------------------------------------
 //  FbSaveHandler::TextHandler
 //---------------------------------------------------------------------------
@@ -602,10 +918,54 @@ bool FbSaveHandler::save()
 
     m_writer.writeStartDocument();
     if (page->isModified()) setDocumentInfo(frame);
-    QString javascript = jScript("export.js");
-    frame->addToJavaScriptWindowObject("handler", this);
-    frame->evaluateJavaScript(javascript);
+    QStringList images;
+    foreach (QWebElement image, frame->findAllElements("img[src]")) {
+        images.append(image.attribute("src"));
+    }
+    m_writer.prefetch(images);
+    QString javascript;
+    if (FbSaveCache *cache = m_writer.cache()) {
+        frame->evaluateJavaScript(jScript("units.js"));
+        javascript = "fbUnits.save(" + cache->versions(m_writer.view().store()) + ");";
+    } else {
+        javascript = jScript("export.js");
+    }
+    QVariant tree = frame->evaluateJavaScript(javascript);
+    bool ok = replay(tree.toString());
     m_writer.writeEndDocument();
 
-    return true;
+    return ok;
+}
+
+// The script returns the whole tree in one string of records, read through
+// FbRecordReader without copying the texts. With the save cache a unit comes after its key and version, to be kept once it is
+// written, or in place of the whole unit there is the key of a kept one.
+bool FbSaveHandler::replay(const QString &tree)
+{
+    QString name;
+    int depth = -1;
+    FbRecordReader reader(tree);
+    while (reader.next()) {
+        const QString &text = reader.text();
+        switch (reader.op()) {
+            case 'A': name = text; break;
+            case 'V': onAttr(name, text); break;
+            case 'N': onNew(text); if (depth >= 0) ++depth; break;
+            case 'T': onTxt(text); break;
+            case 'C': onCom(text); break;
+            case 'E': {
+                onEnd(text);
+                if (depth > 0 && --depth == 0) {
+                    m_writer.endUnit();
+                    depth = -1;
+                }
+            } break;
+            case 'U': m_writer.beginUnit(text); depth = 0; break;
+            case 'R': if (!m_writer.splice(text)) return false; break;
+            case 'a': onAnchor(text.toInt()); break;
+            case 'f': onFocus(text.toInt()); break;
+            default: return false;
+        }
+    }
+    return !reader.hasError() && !tree.isEmpty();
 }
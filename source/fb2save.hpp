@@ -5,13 +5,22 @@
 #include "fb2imgs.hpp"
 
 #include <QByteArray>
+#include <QHash>
 #include <QFileDialog>
+#include <QList>
+#include <QPair>
+#include <QScopedPointer>
 #include <QStringList>
+#include <QThread>
+#include <QUrl>
 #include <QXmlStreamWriter>
 
 QT_BEGIN_NAMESPACE
 class QComboBox;
 class QLabel;
+class QNetworkAccessManager;
+class QSaveFile;
+class QTextEncoder;
 QT_END_NAMESPACE
 
 #include "fb2imgs.hpp"
@@ -66,14 +75,123 @@ private:
     QXmlStreamAttributes m_atts;
 };
 
+// The book as it was when saving started: the text with the places where
+// the binaries go, and references to the binaries that outlive any edits.
+struct FbSaveSnapshot
+{
+    FbSaveSnapshot() : codec("UTF-8"), wrap(true) {}
+    ~FbSaveSnapshot();
+    QString text;
+    QByteArray codec;
+    QList<QPair<int, FbBinary*> > files;
+    bool wrap;
+};
+
+// Downloads the external images of a book before it is written, a few at
+// a time. A request that fails for any reason but a client error, or stalls
+// for longer than the timeout, is tried again after a pause.
+class FbPrefetch : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit FbPrefetch(QNetworkAccessManager *manager, QObject *parent = 0);
+    void setParallel(int count) { m_parallel = qMax(1, count); }
+    void setTimeout(int msec) { m_timeout = msec; }
+    void setRetries(int count) { m_retries = count; }
+    void start(const QList<QUrl> &urls);
+    bool exec(const QList<QUrl> &urls);
+    bool isFinished() const { return m_queue.isEmpty() && !m_running && !m_waiting; }
+    QByteArray data(const QUrl &url) const { return m_data.value(url); }
+    const QList<QUrl> & failed() const { return m_failed; }
+
+signals:
+    void finished();
+
+private slots:
+    void next();
+    void retry();
+    void replyFinished();
+
+private:
+    enum { Parallel = 6, Timeout = 20000, Retries = 2, Pause = 1000 };
+    QNetworkAccessManager *m_manager;
+    QList<QUrl> m_queue;
+    QList<QUrl> m_delayed;
+    QHash<QUrl, int> m_attempts;
+    QHash<QUrl, QByteArray> m_data;
+    int m_running;
+    int m_waiting;
+    int m_parallel;
+    int m_timeout;
+    int m_retries;
+    QList<QUrl> m_failed;
+};
+
+// Serialized top-level units of the page from its previous saves, keyed as
+// in units.js. An entry stays valid for as long as the page keeps the unit
+// at the same version, so a save has to write only the changed units.
+class FbSaveCache
+{
+public:
+    struct Entry {
+        QString version;
+        QString name;
+        QString text;
+        QStringList files;
+    };
+    void clear() { m_entries.clear(); }
+    void insert(const QString &key, const Entry &entry) { m_entries.insert(key, entry); }
+    const Entry * find(const QString &key) const;
+    QString versions(FbStore *store);
+
+private:
+    QHash<QString, Entry> m_entries;
+};
+
+// Encodes a snapshot and writes it through QSaveFile, so the old file
+// stays untouched until the new one is complete.
+class FbSaveThread : public QThread
+{
+    Q_OBJECT
+
+public:
+    explicit FbSaveThread(QObject *parent, const QString &filename, FbSaveSnapshot *snapshot);
+    virtual ~FbSaveThread();
+    const QString & filename() const { return m_filename; }
+    bool isCommitted() const { return m_committed; }
+
+signals:
+    void progress(int percent);
+    void done(bool ok, const QString &error);
+
+protected:
+    void run();
+
+private:
+    bool write(QSaveFile &file, QTextEncoder &encoder, const QString &text);
+    void step(qint64 size);
+
+private:
+    enum { ChunkSize = 64 * 1024 };
+    const QString m_filename;
+    QScopedPointer<FbSaveSnapshot> m_snapshot;
+    qint64 m_total;
+    qint64 m_written;
+    int m_percent;
+    bool m_committed;
+};
+
 class FbSaveWriter : public QXmlStreamWriter
 {
 public:
     explicit FbSaveWriter(FbTextEdit &view, QByteArray *array);
     explicit FbSaveWriter(FbTextEdit &view, QIODevice *device);
     explicit FbSaveWriter(FbTextEdit &view, QString *string);
+    explicit FbSaveWriter(FbTextEdit &view, FbSaveSnapshot *snapshot);
     FbTextEdit & view() { return m_view; }
     QString filename(const QString &src);
+    void prefetch(const QStringList &paths);
     void writeStartDocument();
     void writeStartElement(const QString &name, int level);
     void writeEndElement(int level);
@@ -81,6 +199,11 @@ public:
     void writeLineEnd();
     void writeFiles();
     void writeStyle();
+public:
+    FbSaveCache * cache() const { return m_cache; }
+    void beginUnit(const QString &id);
+    void endUnit();
+    bool splice(const QString &key);
 public:
     int anchor() const { return m_anchor; }
     int focus() const { return m_focus; }
@@ -88,12 +211,18 @@ public:
     void setFocus(int offset);
 private:
     QByteArray downloadFile(const QUrl &url);
-    void writeContentType(const QString &name, QByteArray &data);
+    void writeContentType(FbBinary *file);
     QString append(const QString &name);
 private:
     FbTextEdit &m_view;
     QStringList m_names;
+    QHash<QUrl, QString> m_fetched;
     QString *m_string;
+    FbSaveSnapshot *m_snapshot;
+    FbSaveCache *m_cache;
+    FbSaveCache::Entry m_unit;
+    QString m_unitKey;
+    int m_unitStart;
     QString m_style;
     int m_anchor;
     int m_focus;
@@ -112,6 +241,9 @@ public slots:
     void onAnchor(int offset);
     void onFocus(int offset);
 
+private:
+    bool replay(const QString &tree);
+
 private:
     class TextHandler : public NodeHandler
     {
@@ -0,0 +1,70 @@
+#include "fb2space.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+//---------------------------------------------------------------------------
+//  FbSpace
+//---------------------------------------------------------------------------
+
+bool FbSpace::isSpace(const QChar *data, int size)
+{
+    const ushort *p = reinterpret_cast<const ushort*>(data);
+    for (const ushort *end = p + size; p < end; ++p) {
+        if (!isSpace(*p)) return false;
+    }
+    return true;
+}
+
+// Replaces every run of white space with a single space, so the spaces at
+// both edges are kept, as QString::simplified() followed by the edge checks
+// did. Returns the new length, or zero when there is nothing but spaces.
+int FbSpace::simplify(QChar *data, int size)
+{
+    ushort *p = reinterpret_cast<ushort*>(data);
+    int in = 0;
+    int out = 0;
+    bool space = false;
+    bool text = false;
+
+    while (in < size) {
+#ifdef __SSE2__
+        // Printable ASCII and letters from U+0100 to U+0FFF, where there is no
+        // white space, with single spaces between words are copied eight
+        // characters at a time; anything else goes to the scalar loop.
+        const __m128i blank = _mm_set1_epi16(' ');
+        const __m128i ascii = _mm_set1_epi16(0x80);
+        const __m128i latin = _mm_set1_epi16(0xFF);
+        const __m128i alpha = _mm_set1_epi16(0x1000);
+        while (size - in >= 8) {
+            __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + in));
+            __m128i blanks = _mm_cmpeq_epi16(chunk, blank);
+            __m128i plain = _mm_or_si128(
+                _mm_and_si128(_mm_cmpgt_epi16(chunk, blank), _mm_cmplt_epi16(chunk, ascii)),
+                _mm_and_si128(_mm_cmpgt_epi16(chunk, latin), _mm_cmplt_epi16(chunk, alpha)));
+            if (_mm_movemask_epi8(_mm_or_si128(plain, blanks)) != 0xFFFF) break;
+            int spaces = _mm_movemask_epi8(blanks);
+            if (spaces & (spaces >> 2)) break;
+            if (space && (spaces & 1)) break;
+            if (out != in) _mm_storeu_si128(reinterpret_cast<__m128i*>(p + out), chunk);
+            if (spaces != 0xFFFF) text = true;
+            space = spaces & 0x4000;
+            in += 8;
+            out += 8;
+        }
+        if (in == size) break;
+#endif
+        ushort ch = p[in++];
+        if (isSpace(ch)) {
+            if (!space) p[out++] = ' ';
+            space = true;
+        } else {
+            p[out++] = ch;
+            space = false;
+            text = true;
+        }
+    }
+
+    return text ? out : 0;
+}
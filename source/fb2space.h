@@ -0,0 +1,15 @@
+#ifndef FB2SPACE_H
+#define FB2SPACE_H
+
+#include <QChar>
+
+class FbSpace
+{
+public:
+    static bool isSpace(ushort ch)
+        { return ch == ' ' || (ch >= 0x09 && ch <= 0x0d) || (ch > 127 && QChar::isSpace(ch)); }
+    static bool isSpace(const QChar *data, int size);
+    static int simplify(QChar *data, int size);
+};
+
+#endif // FB2SPACE_H
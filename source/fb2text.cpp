@@ -567,6 +567,12 @@ bool FbTextEdit::save(QByteArray *array)
     return FbSaveHandler(writer).save();
 }
 
+bool FbTextEdit::save(FbSaveSnapshot *snapshot)
+{
+    FbSaveWriter writer(*this, snapshot);
+    return FbSaveHandler(writer).save();
+}
+
 bool FbTextEdit::save(QString *string, int &anchor, int &focus)
 {
     FbSaveWriter writer(*this, string);
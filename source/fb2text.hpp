@@ -19,6 +19,7 @@ QT_END_NAMESPACE
 
 class FbNoteView;
 class FbReadThread;
+struct FbSaveSnapshot;
 class FbTextPage;
 
 class FbDockWidget : public QDockWidget
@@ -79,6 +80,7 @@ public:
     bool save(QIODevice *device, const QString &codec = QString());
     bool save(QString *string, int &anchor, int &focus);
     bool save(QByteArray *array);
+    bool save(FbSaveSnapshot *snapshot);
     QString toHtml();
 
     QAction * act(Fb::Actions index) const;
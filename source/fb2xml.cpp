@@ -1,6 +1,69 @@
 #include "fb2xml.hpp"
+#include "fb2space.h"
 #include <QtDebug>
 
+#include <cstring>
+
+//---------------------------------------------------------------------------
+//  FbHandlerPool
+//---------------------------------------------------------------------------
+
+// Handlers live exactly as long as their elements, so the freed blocks are
+// kept by the parsing thread and reused for the next elements of the size.
+class FbHandlerPool
+{
+public:
+    FbHandlerPool() { memset(m_free, 0, sizeof(m_free)); }
+    ~FbHandlerPool();
+    void * alloc(size_t size);
+    void free(void *p, size_t size);
+private:
+    enum { Granularity = 16, Classes = 16 };
+    struct Block { Block *next; };
+    static int index(size_t size) { return int((size + Granularity - 1) / Granularity) - 1; }
+    Block *m_free[Classes];
+};
+
+FbHandlerPool::~FbHandlerPool()
+{
+    for (int i = 0; i < Classes; ++i) {
+        while (Block *block = m_free[i]) {
+            m_free[i] = block->next;
+            ::operator delete(block);
+        }
+    }
+}
+
+void * FbHandlerPool::alloc(size_t size)
+{
+    int i = index(size);
+    if (i >= Classes) return ::operator new(size);
+    if (Block *block = m_free[i]) {
+        m_free[i] = block->next;
+        return block;
+    }
+    return ::operator new((i + 1) * Granularity);
+}
+
+void FbHandlerPool::free(void *p, size_t size)
+{
+    if (!p) return;
+    int i = index(size);
+    if (i >= Classes) {
+        ::operator delete(p);
+        return;
+    }
+    Block *block = static_cast<Block*>(p);
+    block->next = m_free[i];
+    m_free[i] = block;
+}
+
+static FbHandlerPool & handlerPool()
+{
+    static thread_local FbHandlerPool pool;
+    return pool;
+}
+
 //---------------------------------------------------------------------------
 //  FbXmlHandler::NodeHandler
 //---------------------------------------------------------------------------
@@ -15,40 +78,22 @@ QString FbXmlHandler::NodeHandler::Value(const QXmlStreamAttributes &attributes,
     return QString();
 }
 
-bool FbXmlHandler::NodeHandler::doStart(const QString &name, const QXmlStreamAttributes &attributes)
+FbXmlHandler::NodeHandler * FbXmlHandler::NodeHandler::doStart(const QStringRef &qName, const QXmlStreamAttributes &attributes)
 {
-    if (m_handler) return m_handler->doStart(name, attributes);
-    m_handler = NewTag(name, attributes);
-    if (m_handler) {
-        if (m_handler->m_closed) {
-            delete m_handler;
-            m_handler = NULL;
-        }
-        return true;
-    }
-    m_handler = new NodeHandler(name);
-    return true;
+    // The only copy of the name is made here, it is kept by the new handler.
+    const QString name = lowerName(qName);
+    NodeHandler *handler = NewTag(name, attributes);
+    return handler ? handler : new NodeHandler(name);
 }
 
-bool FbXmlHandler::NodeHandler::doText(const QString &text)
+void * FbXmlHandler::NodeHandler::operator new(size_t size)
 {
-    if (m_handler) m_handler->doText(text); else TxtTag(text);
-    return true;
+    return handlerPool().alloc(size);
 }
 
-bool FbXmlHandler::NodeHandler::doEnd(const QString &name, bool & exists)
+void FbXmlHandler::NodeHandler::operator delete(void *p, size_t size)
 {
-    if (m_handler) {
-        bool found = exists || name == m_name;
-        m_handler->doEnd(name, found);
-        if (m_handler->m_closed) { delete m_handler; m_handler = NULL; }
-        if (found) { exists = true; return true; }
-    }
-    bool found = name == m_name;
-    m_closed = found || exists;
-    if (m_closed) EndTag(m_name);
-    exists = found;
-    return true;
+    handlerPool().free(p, size);
 }
 
 //---------------------------------------------------------------------------
@@ -58,42 +103,67 @@ bool FbXmlHandler::NodeHandler::doEnd(const QString &name, bool & exists)
 FbXmlHandler::FbXmlHandler()
     : QObject()
     , m_handler(0)
+    , m_stopped(false)
 {
 }
 
 FbXmlHandler::~FbXmlHandler()
 {
+    while (!m_stack.isEmpty()) {
+        NodeHandler *handler = m_stack.takeLast();
+        if (handler != m_handler) delete handler;
+    }
     if (m_handler) delete m_handler;
 }
 
-bool FbXmlHandler::startElement(const QString &, const QString &, const QString &qName, const QXmlStreamAttributes &attributes)
+QString FbXmlHandler::lowerName(const QStringRef &name)
 {
-    const QString name = qName.toLower();
-    if (m_handler) return m_handler->doStart(name, attributes);
-    m_handler = CreateRoot(name, attributes);
-    return m_handler;
+    for (const QChar &ch : name) {
+        if (ch.isUpper()) return name.toString().toLower();
+    }
+    return name.toString();
+}
+
+bool FbXmlHandler::startElement(const QStringRef &qName, const QXmlStreamAttributes &attributes)
+{
+    if (!m_handler) {
+        m_handler = CreateRoot(lowerName(qName), attributes);
+        if (m_handler) m_stack.append(m_handler);
+        return m_handler;
+    }
+    if (!m_stack.isEmpty()) m_stack.append(m_stack.last()->doStart(qName, attributes));
+    return !m_stopped;
 }
 
 bool FbXmlHandler::isWhiteSpace(const QString &str)
 {
-    return str.simplified().isEmpty();
+    return FbSpace::isSpace(str.constData(), str.size());
 }
 
-bool FbXmlHandler::characters(const QString &str)
+bool FbXmlHandler::characters(const QStringRef &str)
 {
-    QString s = str.simplified();
-    if (s.isEmpty()) return true;
-    if (isWhiteSpace(str.left(1))) s.prepend(" ");
-    if (isWhiteSpace(str.right(1))) s.append(" ");
-    return m_handler && m_handler->doText(s);
+    // Indentation between elements is dropped before anything is copied.
+    if (FbSpace::isSpace(str.unicode(), str.size())) return true;
+    QString s = str.toString();
+    s.truncate(FbSpace::simplify(s.data(), s.size()));
+    if (!m_stack.isEmpty()) m_stack.last()->doText(s);
+    return m_handler;
 }
 
-bool FbXmlHandler::endElement(const QString & namespaceURI, const QString & localName, const QString &qName)
+bool FbXmlHandler::endElement(const QStringRef &qName)
 {
-    Q_UNUSED(namespaceURI);
-    Q_UNUSED(localName);
-    bool found = false;
-    return m_handler && m_handler->doEnd(qName.toLower(), found);
+    // A mismatched end tag closes the innermost element of that name
+    // with everything inside it, an unknown one is ignored.
+    for (int i = m_stack.size() - 1; i >= 0; --i) {
+        if (!m_stack.at(i)->isNamed(qName)) continue;
+        while (m_stack.size() > i) {
+            NodeHandler *handler = m_stack.takeLast();
+            handler->doEnd();
+            if (handler != m_handler) delete handler;
+        }
+        break;
+    }
+    return m_handler;
 }
 
 bool FbXmlHandler::warning(const QString &msg, int row, int col)
@@ -2,28 +2,51 @@
 #define FB2XML_H
 
 #include <QHash>
+#include <QVector>
 #include <QXmlStreamReader>
 #include <QXmlStreamWriter>
 
 
+// Case-insensitive FNV-1a hash of ASCII keywords. The keyword hashes are
+// computed at compile time and become case labels of a switch, so the
+// compiler rejects any collision inside a keyword list.
+class FbKeyword
+{
+public:
+    static constexpr quint32 hash(const char *str, quint32 seed = 2166136261u)
+        { return *str ? hash(str + 1, (seed ^ lower(uchar(*str))) * 16777619u) : seed; }
+    static quint32 hash(const QChar *data, int size)
+    {
+        quint32 seed = 2166136261u;
+        for (const QChar *end = data + size; data < end; ++data) seed = (seed ^ lower(data->unicode())) * 16777619u;
+        return seed;
+    }
+    static quint32 hash(const QString &str)
+        { return hash(str.constData(), str.size()); }
+    static bool equal(const QString &str, const char *key)
+        { return str.compare(QLatin1String(key), Qt::CaseInsensitive) == 0; }
+private:
+    static constexpr quint32 lower(quint32 ch)
+        { return ch >= 'A' && ch <= 'Z' ? ch + ('a' - 'A') : ch; }
+};
+
 #define FB2_BEGIN_KEYLIST private: enum Keyword {
 
 #define FB2_END_KEYLIST None }; \
-class KeywordHash : public QHash<QString, Keyword> { public: KeywordHash(); }; \
 static Keyword toKeyword(const QString &name); private:
 
 #define FB2_BEGIN_KEYHASH(x) \
 x::Keyword x::toKeyword(const QString &name) \
 {                                                                    \
-    static const KeywordHash map;                                    \
-    KeywordHash::const_iterator i = map.find(name);                  \
-    return i == map.end() ? None : i.value();                        \
-}                                                                    \
-x::KeywordHash::KeywordHash() {
+    switch (FbKeyword::hash(name)) {
 
-#define FB2_END_KEYHASH }
+#define FB2_END_KEYHASH                                              \
+        default: ;                                                   \
+    }                                                                \
+    return None;                                                     \
+}
 
-#define FB2_KEY(key,str) insert(str,key);
+#define FB2_KEY(key,str) case FbKeyword::hash(str): return FbKeyword::equal(name, str) ? key : None;
 
 class FbXmlHandler : public QObject
 {
@@ -32,10 +55,10 @@ class FbXmlHandler : public QObject
 public:
     explicit FbXmlHandler();
     virtual ~FbXmlHandler();
-    bool startElement(const QString &namespaceURI, const QString &localName, const QString &qName, const QXmlStreamAttributes &attributes);
-    bool endElement(const QString &namespaceURI, const QString &localName, const QString &qName);
-    bool characters(const QString &str);
-    bool comment(const QString &){return true;}
+    bool startElement(const QStringRef &qName, const QXmlStreamAttributes &attributes);
+    bool endElement(const QStringRef &qName);
+    bool characters(const QStringRef &str);
+    bool comment(const QStringRef &){return true;}
     bool error(const QString &msg, int row, int col);
     bool warning(const QString &msg, int row, int col);
     bool fatalError(const QString &msg, int row, int col);
@@ -51,13 +74,20 @@ protected:
     {
     public:
         static QString Value(const QXmlStreamAttributes &attributes, const QString &name);
+        static void * operator new(size_t size);
+        static void operator delete(void *p, size_t size);
         explicit NodeHandler(const QString &name)
-            : m_name(name), m_handler(0), m_closed(false) {}
-        virtual ~NodeHandler()
-            { if (m_handler) delete m_handler; }
-        bool doStart(const QString &name, const QXmlStreamAttributes &attributes);
-        bool doText(const QString &text);
-        bool doEnd(const QString &name, bool & found);
+            : m_name(name) {}
+        virtual ~NodeHandler() {}
+        NodeHandler * doStart(const QStringRef &name, const QXmlStreamAttributes &attributes);
+        // Unlike names, text is passed as an owned string: it is simplified
+        // in place, and every handler keeps or writes it as a QString.
+        void doText(const QString &text)
+            { TxtTag(text); }
+        void doEnd()
+            { EndTag(m_name); }
+        bool isNamed(const QStringRef &name) const
+            { return name.compare(m_name, Qt::CaseInsensitive) == 0; }
     protected:
         virtual NodeHandler * NewTag(const QString &name, const QXmlStreamAttributes &attributes)
             { Q_UNUSED(name); Q_UNUSED(attributes); return NULL; }
@@ -69,17 +99,19 @@ protected:
             { return m_name; }
     private:
         const QString m_name;
-        NodeHandler * m_handler;
-        bool m_closed;
     };
 
 protected:
     virtual NodeHandler * CreateRoot(const QString &name, const QXmlStreamAttributes &attributes) = 0;
     static bool isWhiteSpace(const QString &str);
+    static QString lowerName(const QStringRef &name);
+    void stop() { m_stopped = true; }
 
 protected:
     NodeHandler * m_handler;
+    QVector<NodeHandler*> m_stack;
     QString m_error;
+    bool m_stopped;
 };
 
 #endif // FB2XML_H
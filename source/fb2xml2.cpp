@@ -1,10 +1,38 @@
 #include "fb2xml2.h"
 
+#include <climits>
 #include <cstring>
 #include <QtDebug>
 
 namespace XML2 {
 
+//---------------------------------------------------------------------------
+//  XML2::XmlMappedFile
+//---------------------------------------------------------------------------
+
+XmlMappedFile::XmlMappedFile(QIODevice *device)
+    : m_file(qobject_cast<QFile*>(device))
+    , m_map(nullptr)
+{
+    if (m_file && m_file->isOpen()) {
+        qint64 pos = m_file->pos();
+        qint64 size = m_file->size() - pos;
+        if (size > 0 && size < INT_MAX) m_map = m_file->map(pos, size);
+        if (m_map) {
+            m_data = QByteArray::fromRawData(reinterpret_cast<const char*>(m_map), int(size));
+            m_file->seek(pos + size);
+            return;
+        }
+    }
+    m_data = device->readAll();
+}
+
+XmlMappedFile::~XmlMappedFile(void)
+{
+    m_data.clear();
+    if (m_map) m_file->unmap(m_map);
+}
+
 //---------------------------------------------------------------------------
 //  XML2::XmlReader
 //---------------------------------------------------------------------------
@@ -46,23 +74,22 @@ bool XmlReaderPrivate::process(QXmlStreamReader &reader)
 
         switch (reader.tokenType()) {
         case QXmlStreamReader::StartElement:
-            if (!contenthandler->startElement(reader.namespaceUri().toString(), reader.name().toString(),
-                                              reader.qualifiedName().toString(), reader.attributes())) {
+            if (!contenthandler->startElement(reader.qualifiedName(), reader.attributes())) {
                 return false;
             }
             break;
         case QXmlStreamReader::EndElement:
-            if (!contenthandler->endElement(reader.namespaceUri().toString(), reader.name().toString(),
-                                            reader.qualifiedName().toString())) {
+            if (!contenthandler->endElement(reader.qualifiedName())) {
                 return false;
             }
+            break;
         case QXmlStreamReader::Characters:
-            if (!contenthandler->characters(reader.text().toString())) {
+            if (!contenthandler->characters(reader.text())) {
                 return false;
             }
             break;
         case QXmlStreamReader::Comment:
-            if (lexicalhandler && !lexicalhandler->comment(reader.text().toString())) {
+            if (lexicalhandler && !lexicalhandler->comment(reader.text())) {
                 return false;
             }
             break;
@@ -83,6 +110,13 @@ bool XmlReaderPrivate::parse(const QString *input)
 
 bool XmlReaderPrivate::parse(QIODevice *input)
 {
+    // A local file is tokenized in place instead of being read in chunks.
+    if (qobject_cast<QFile*>(input)) {
+        XmlMappedFile file(input);
+        QXmlStreamReader reader(file.data());
+        return process(reader);
+    }
+
     QXmlStreamReader reader(input);
 
     return process(reader);
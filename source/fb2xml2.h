@@ -8,6 +8,23 @@ namespace XML2 {
 
 class XmlReaderPrivate;
 
+// Contents of a device, mapped into memory when the device is a local file
+// and read otherwise. The data is valid while the object exists.
+class XmlMappedFile
+{
+public:
+    explicit XmlMappedFile(QIODevice *device);
+    ~XmlMappedFile(void);
+    const QByteArray & data() const { return m_data; }
+    bool isMapped() const { return m_map; }
+
+private:
+    Q_DISABLE_COPY(XmlMappedFile)
+    QFile *m_file;
+    uchar *m_map;
+    QByteArray m_data;
+};
+
 class XmlReader
 {
 public:
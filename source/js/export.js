@@ -2,23 +2,31 @@
     var selection = document.getSelection();
     var anchorNode = selection.anchorNode;
     var focusNode = selection.focusNode;
+    var out = [];
+    var put = function(op, text) {
+        out.push(op, text.length, ":", text);
+    }
     var f = function(node) {
         if (node.nodeName === "#text") {
-            handler.onTxt(node.data);
-            if (anchorNode === node) handler.onAnchor(selection.anchorOffset);
-            if (focusNode === node) handler.onFocus(selection.focusOffset);
+            put("T", node.data);
+            if (anchorNode === node) put("a", String(selection.anchorOffset));
+            if (focusNode === node) put("f", String(selection.focusOffset));
         } else if (node.nodeName === "#comment") {
-            handler.onCom(node.data);
+            put("C", node.data);
         } else {
             var atts = node.attributes;
             var count = atts.length;
-            for (var i = 0; i < count; ++i) handler.onAttr(atts[i].name, atts[i].value);
-            handler.onNew(node.nodeName);
+            for (var i = 0; i < count; ++i) {
+                put("A", atts[i].name);
+                put("V", atts[i].value);
+            }
+            put("N", node.nodeName);
             for (var n = node.firstChild; n !== null; n = n.nextSibling) f(n);
-            handler.onEnd(node.nodeName);
+            put("E", node.nodeName);
         }
     }
-    handler.onNew(root.nodeName);
+    put("N", root.nodeName);
     for (var n = root.firstChild; n !== null; n = n.nextSibling) f(n);
-    handler.onEnd(root.nodeName);
+    put("E", root.nodeName);
+    return out.join("");
 })(document);
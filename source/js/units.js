@@ -0,0 +1,161 @@
+(function() {
+    if (window.fbUnits) return false;
+    var body = document.body;
+    var units = window.fbUnits = { prefix: Date.now().toString(36) + "-", next: 0, clock: 0, dirty: [], layout: true, full: false, reset: false };
+    // Units are the children of the blocks under the body. Each one gets a key
+    // and a version that grows with every change inside the unit.
+    var isUnit = function(node) {
+        return node.nodeType === 1 && node.parentNode && node.parentNode.parentNode === body;
+    }
+    var key = function(node) {
+        if (!node.fbKey) {
+            node.fbKey = units.prefix + (++units.next);
+            node.fbVersion = ++units.clock;
+            node.fbDirty = true;
+            units.dirty.push(node);
+        }
+        return node.fbKey;
+    }
+    var touch = function(node) {
+        var unit = false;
+        for (; node && node !== body; node = node.parentNode) {
+            if (node.fbKey) {
+                node.fbVersion = ++units.clock;
+                if (!node.fbDirty) {
+                    node.fbDirty = true;
+                    units.dirty.push(node);
+                }
+            }
+            if (isUnit(node)) unit = true;
+        }
+        if (!unit) units.layout = true;
+    }
+    var changed = function(records) {
+        for (var i = 0; i < records.length; ++i) {
+            var record = records[i];
+            touch(record.target);
+            var added = record.addedNodes;
+            for (var j = 0; added && j < added.length; ++j) touch(added[j]);
+        }
+    }
+    var Observer = window.MutationObserver || window.WebKitMutationObserver;
+    var observer = null;
+    if (Observer) {
+        observer = new Observer(changed);
+        observer.observe(document.documentElement, { childList: true, attributes: true, characterData: true, subtree: true });
+    } else {
+        units.full = true;
+    }
+    // The versions are only as recent as the records delivered so far, so
+    // the pending ones are taken before the units are walked.
+    var flush = function() {
+        if (observer) changed(observer.takeRecords());
+    }
+    // Returns the skeleton of the page, if it has changed, followed by pairs
+    // of keys and records of the units changed since the last call. In the
+    // skeleton the units are replaced by references to their keys.
+    units.checkpoint = function() {
+        flush();
+        var all = units.full || units.reset;
+        var out = [];
+        var put = function(op, text) {
+            out.push(op, text.length, ":", text);
+        }
+        var f = function(node, skeleton) {
+            if (node.nodeType === 3) {
+                put("T", node.data);
+            } else if (node.nodeType === 8) {
+                put("C", node.data);
+            } else if (node.nodeType === 1) {
+                if (skeleton && isUnit(node)) {
+                    key(node);
+                    if (all && !node.fbDirty) {
+                        node.fbDirty = true;
+                        units.dirty.push(node);
+                    }
+                    put("R", node.fbKey);
+                    return;
+                }
+                var atts = node.attributes;
+                var count = atts.length;
+                for (var i = 0; i < count; ++i) {
+                    put("A", atts[i].name);
+                    put("V", atts[i].value);
+                }
+                put("N", node.nodeName);
+                for (var n = node.firstChild; n !== null; n = n.nextSibling) f(n, skeleton);
+                put("E", node.nodeName);
+            }
+        }
+        var result = [""];
+        if (units.layout || all) {
+            for (var n = document.firstChild; n !== null; n = n.nextSibling) f(n, true);
+            result[0] = out.join("");
+            units.layout = false;
+            units.reset = false;
+        }
+        var dirty = units.dirty;
+        units.dirty = [];
+        for (var i = 0; i < dirty.length; ++i) {
+            var unit = dirty[i];
+            unit.fbDirty = false;
+            if (!isUnit(unit)) continue;
+            out = [];
+            f(unit, false);
+            result.push(unit.fbKey, out.join(""));
+        }
+        return result;
+    }
+    // The next checkpoint writes the skeleton and every unit again, as for
+    // a journal started afresh.
+    units.restart = function() {
+        units.layout = true;
+        units.reset = true;
+    }
+    // Returns the records of export.js, except that a unit found in cached at
+    // its current version is replaced by a reference to its key, and every
+    // other unit is preceded by its key and version.
+    units.save = function(cached) {
+        flush();
+        var selection = document.getSelection();
+        var anchorNode = selection.anchorNode;
+        var focusNode = selection.focusNode;
+        var out = [];
+        var put = function(op, text) {
+            out.push(op, text.length, ":", text);
+        }
+        var f = function(node, skeleton) {
+            if (node.nodeName === "#text") {
+                put("T", node.data);
+                if (anchorNode === node) put("a", String(selection.anchorOffset));
+                if (focusNode === node) put("f", String(selection.focusOffset));
+            } else if (node.nodeName === "#comment") {
+                put("C", node.data);
+            } else {
+                if (skeleton && !units.full && isUnit(node)) {
+                    var selected = node.contains(anchorNode) || node.contains(focusNode);
+                    if (!selected && cached[key(node)] === node.fbVersion) {
+                        put("R", node.fbKey);
+                        return;
+                    }
+                    put("U", node.fbKey + ":" + node.fbVersion);
+                    skeleton = false;
+                }
+                var atts = node.attributes;
+                var count = atts.length;
+                for (var i = 0; i < count; ++i) {
+                    put("A", atts[i].name);
+                    put("V", atts[i].value);
+                }
+                put("N", node.nodeName);
+                for (var n = node.firstChild; n !== null; n = n.nextSibling) f(n, skeleton);
+                put("E", node.nodeName);
+            }
+        }
+        put("N", document.nodeName);
+        for (var n = document.firstChild; n !== null; n = n.nextSibling) f(n, true);
+        put("E", document.nodeName);
+        return out.join("");
+    }
+    return true;
+})();